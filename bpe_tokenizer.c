@@ -1,371 +1,3401 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
+#include <inttypes.h>
 #include <string.h>
 #include <ctype.h>
 #include <pthread.h>
 #include <time.h>
-#include <wchar.h>
-#include <locale.h>
 #include <assert.h>
-#include <wctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#define DELIMITER_CMP_MODE (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK)  // PCMPESTRM takes an immediate
+#endif
 
-#define MAX_TOKENS 100000
+#define MIN_TOKEN_SPANS 64
 #define MAX_TOKEN_LEN 128
-#define MAX_PAIR_LEN 256
 #define HASH_SIZE 10000
+#define VOCAB_INDEX_INITIAL 1024
+#define PAIR_TABLE_INITIAL 1024
+#define NO_PAIR UINT32_MAX
+#define BPE_UNK_ID UINT32_MAX               // ID emitted for characters outside the base alphabet
+#define MERGES_FORMAT_VERSION 1
+#define MODEL_MAGIC "BPEMODEL"
+#define MODEL_FORMAT_VERSION 2
+#define MODEL_BYTE_ORDER 0x01020304u        // written natively; a mismatch means foreign endianness
+#define MODEL_FLAG_BYTE_LEVEL 1u
+#define MODEL_SECTION_ALIGN 8
+#define BPE_UNK_TEXT "\xEF\xBF\xBD"          // U+FFFD, what bpe_decode writes for unknown IDs
+#define ENCODE_CACHE_CAPACITY 16384         // default number of cached words
+#define ENCODE_CACHE_STRIPES 16             // independently locked cache partitions
+#define ENCODE_CACHE_WORD_MAX 24            // longer words bypass the cache
+#define ENCODE_CACHE_IDS_MAX 8              // words encoding to more IDs bypass the cache
+#define BATCH_CHUNK_BYTES (1 << 16)         // documents are split into tasks of about this size
+#define READ_CHUNK_SIZE (1 << 16)
 #define MAX_VOCAB_SIZE 50000
 #define MIN_TOKEN_FREQ 2
 #define MAX_THREADS 8
+#define MIN_WORDS_PER_THREAD 1024
+#define MIN_BYTES_PER_THREAD (1 << 20)      // smallest corpus shard worth its own counting thread
+#define SPILL_MAX_RUNS 64                   // spilled runs kept open before they are merged into one
+#define DELIMITER_BLOCK 32
+#define BYTE_ALPHABET 256                   // base symbols of byte-level mode
+#define CASE_FOLD_PAGES 256                 // BMP split into pages of 256 code points
+
+// Run of code points lowercased by the same offset: first, first + stride, ... up to last
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+    int32_t delta;
+    uint32_t stride;
+} CaseFoldRange;
+
+// Pairs of symbol IDs packed into one 64-bit key
+#define PAIR_KEY(left, right) (((uint64_t)(left) << 32) | (uint32_t)(right))
+#define PAIR_LEFT(key) ((uint32_t)((key) >> 32))
+#define PAIR_RIGHT(key) ((uint32_t)(key))
+
+// Symbol slot of a word; a merge folds the right slot into the left one and unlinks it
+typedef struct {
+    uint32_t symbol;
+    int prev;                   // -1 at the start of the word
+    int next;                   // -1 at the end of the word
+} SymbolSlot;
 
 // Vocabulary entry (word or subword)
 typedef struct {
-    wchar_t *token;
+    char *token;                // UTF-8 word
     uint32_t id;
-    int freq;
+    int64_t freq;
+    SymbolSlot *symbols;        // linked subword slots starting at slot 0, NULL until convert_vocab_to_subwords
+    int symbol_count;           // live slots
 } VocabEntry;
 
-// BPE pair structure
-typedef struct BPE_Pair {
-    wchar_t pair[MAX_PAIR_LEN];
-    int count;
+// Interned symbol hash chain node; the text lives in symbol_text[id]
+typedef struct SymbolEntry {
     uint32_t id;
-    struct BPE_Pair *next;
+    struct SymbolEntry *next;
+} SymbolEntry;
+
+// BPE pair record; records keep their index for life, so the heap refers to them by index
+typedef struct {
+    uint64_t key;
+    int64_t count;
+    uint32_t id;                // first word the pair was seen in
+    uint32_t *words;            // indices of vocabulary words containing the pair (may be stale)
+    int word_count;
+    int word_capacity;
 } BPE_Pair;
 
+// Open-addressing slot: the packed pair key stored inline next to its record index
+typedef struct {
+    uint64_t key;
+    uint32_t index;             // NO_PAIR when the slot is empty
+} BPE_PairSlot;
+
+// Max-heap entry: a snapshot of a pair count, stale once the pair count moves on
+typedef struct {
+    int64_t count;
+    uint32_t pair;              // record index; records are numbered in first-seen order
+} BPE_HeapEntry;
+
 // Hashmap structure for storing BPE pairs
+// Linear probing over a power-of-two slot array kept at most half full; records live densely in
+// first-seen order. A map has a single owner: worker threads count into private maps.
+// The heap is lazily kept in sync by update_pair and is only touched by the merge loop.
+// In byte-level mode pairs of two base bytes skip hashing through a dense 256x256 index
 typedef struct {
-    BPE_Pair **table;
-    pthread_mutex_t *mutexes;
+    BPE_PairSlot *slots;
+    uint32_t slot_capacity;
+    uint32_t *byte_pairs;       // record index per byte pair, NULL outside byte-level mode
+    BPE_Pair *pairs;
+    uint32_t pair_count;
+    uint32_t pair_capacity;
+    BPE_HeapEntry *heap;
+    int heap_size;
+    int heap_capacity;
 } BPE_HashMap;
 
+// Open-addressing slot mapping a word hash to its vocabulary index (-1 when empty)
+typedef struct {
+    uint32_t hash;
+    int index;
+} VocabIndexEntry;
+
 VocabEntry *vocabulary = NULL;
 int vocab_size = 0;
+int vocab_capacity = 0;
+VocabIndexEntry *vocab_index = NULL;
+int vocab_index_capacity = 0;       // power of two, kept at least twice vocab_size
+int vocab_limit = MAX_VOCAB_SIZE;   // words beyond this many distinct ones are dropped
+
+// Token view: a span of the lowercased UTF-8 text owned by a TokenList
+typedef struct {
+    size_t offset;
+    size_t length;
+} TokenSpan;
+
+// Tokens produced by tokenize; spans grow on demand instead of being preallocated
+typedef struct {
+    char *text;                 // lowercased tokens, each NUL-terminated
+    TokenSpan *spans;
+    int count;
+    int capacity;
+} TokenList;
+
+// Word and its count in a private word table
+typedef struct {
+    char *word;
+    size_t len;
+    unsigned int hash;
+    int64_t freq;
+} WordCount;
+
+// Private word counts of one corpus shard, in first-seen order, with a linear-probing index
+typedef struct {
+    WordCount *words;
+    int count;
+    int capacity;
+    int *slots;                 // index into words, -1 when empty
+    int slot_capacity;          // power of two, kept at least twice count
+    size_t word_bytes;          // bytes held by the word strings
+} WordTable;
+
+// Sorted run of word counts in an unlinked temporary file: records of a uint32_t length, an
+// int64_t count and the word bytes, in byte order of the words
+typedef struct {
+    FILE *fp;
+    char *word;                 // current record while the run is being merged
+    uint32_t len;
+    uint32_t capacity;
+    int64_t freq;
+} WordRun;
+
+// Out-of-core word counts: words are counted in a table until it outgrows the memory budget,
+// then written out as a sorted run; the runs are combined by a k-way merge at the end
+typedef struct {
+    WordTable table;
+    size_t budget;              // bytes the table may use before it is spilled
+    WordRun *runs;
+    int run_count;
+    int run_capacity;
+    int max_runs;               // open runs before they are merged into one
+    int spilled;                // runs written in total, before any were merged
+} WordSpill;
+
+// Incremental UTF-8 word scanner shared by the streaming and memory-mapped readers
+// Words are split on raw bytes; only a word cut off at the end of a block is copied
+typedef struct {
+    WordTable *table;           // destination of the words; NULL adds them to the global vocabulary
+    WordSpill *spill;           // out-of-core destination, used instead of table when set
+    char *word;                 // pending bytes of a word that continues in the next block
+    size_t word_len;
+    size_t word_capacity;
+    char *lower;                // lowercasing buffer, at least twice the longest word
+    size_t lower_capacity;
+    int64_t token_count;
+} WordScanner;
+
+// Work item for one word-counting thread: a delimiter-aligned byte range of a mapped corpus
+typedef struct {
+    const char *data;
+    size_t start;
+    size_t end;
+    const char *name;
+    WordTable table;
+    WordSpill *spill;           // the range's own spill while word counts go to disk, else NULL
+    int64_t token_count;        // -1 if the range failed to scan
+} WordCountTask;
+
+// SpaceSaving counter: an estimated count that exceeds the true one by at most error
+typedef struct {
+    char *word;
+    size_t len;
+    unsigned int hash;
+    int64_t count;
+    int64_t error;              // count inherited from the word this counter was taken from
+    int next;                   // next counter in the same bucket, -1 at the end
+    int heap_pos;               // position in the min-heap
+} HeavyHitter;
+
+// Streaming heavy-hitter summary over a fixed number of counters (SpaceSaving)
+// A word without a counter takes over the one with the smallest count, found at the top of a
+// min-heap, so memory stays fixed however many distinct words the corpus has
+typedef struct {
+    HeavyHitter *counters;
+    int count;
+    int capacity;
+    int *buckets;               // first counter of each hash bucket, -1 when empty
+    unsigned int bucket_mask;
+    int *heap;                  // counter indices, min-heap by count
+} HeavyHitterTable;
+
+// Work item for one pair-counting thread: a slice of the vocabulary and its private table
+typedef struct {
+    int start;
+    int end;
+    BPE_HashMap *local;
+} PairCountTask;
+
+// One learned merge; its position in the merge list is its rank
+typedef struct {
+    uint32_t left;
+    uint32_t right;
+    uint32_t merged;
+} BPE_Merge;
+
+// Rank table slot, probed linearly by packed pair key; plain values only, so the table can
+// be stored and mapped as is
+typedef struct {
+    uint64_t key;
+    uint32_t rank;              // NO_PAIR marks an empty slot
+    uint32_t merged;
+} BPE_RankSlot;
+
+// Base alphabet slot of a character-level model: code point -> symbol ID
+typedef struct {
+    uint32_t code_point;
+    uint32_t id;                // BPE_UNK_ID marks an empty slot
+} BPE_CharSlot;
+
+// Cached encoding of one lowercased word, stored inline so lookups never chase pointers
+typedef struct {
+    uint32_t hash;
+    int32_t next;               // next entry in the same bucket, -1 at the end
+    uint8_t word_len;
+    uint8_t id_count;
+    uint8_t referenced;         // CLOCK bit, set on every hit
+    char word[ENCODE_CACHE_WORD_MAX];
+    uint32_t ids[ENCODE_CACHE_IDS_MAX];
+} BPE_CacheEntry;
+
+// One lock-protected partition of the encode cache: a fixed ring of entries evicted by CLOCK,
+// indexed by chained buckets
+typedef struct {
+    pthread_mutex_t lock;
+    BPE_CacheEntry *entries;
+    int32_t *buckets;           // first entry of each bucket, -1 when empty
+    uint32_t bucket_mask;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t hand;              // CLOCK hand over entries
+    uint64_t hits;
+    uint64_t misses;
+} BPE_CacheStripe;
+
+// Bounded word -> IDs cache shared by all threads encoding with a model
+typedef struct {
+    BPE_CacheStripe stripes[ENCODE_CACHE_STRIPES];
+} BPE_EncodeCache;
+
+// Double-array trie node over symbol bytes: the child of node s on byte c is t = base + c + 1
+// when check[t] == s
+typedef struct {
+    int32_t base;
+    int32_t check;              // parent node, -1 while the slot is free
+    uint32_t value;             // symbol spelled by the path to this node, or BPE_UNK_ID
+} BPE_TrieNode;
+
+// Sort key used while building the trie
+typedef struct {
+    const char *text;
+    uint32_t len;
+    uint32_t id;
+} BPE_TrieKey;
+
+// Pending trie node during the build: keys [lo, hi) share its first depth bytes
+typedef struct {
+    uint32_t node;
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t depth;
+} BPE_TrieBuildItem;
+
+// Header of a binary model file; every section is a plain array at an aligned file offset,
+// so a mapped file is used in place
+typedef struct {
+    char magic[8];              // MODEL_MAGIC, not NUL-terminated
+    uint32_t version;
+    uint32_t byte_order;        // MODEL_BYTE_ORDER
+    uint32_t flags;
+    uint32_t base_count;
+    uint32_t symbol_count;
+    uint32_t merge_count;
+    uint32_t rank_capacity;
+    uint32_t char_capacity;
+    uint64_t file_size;
+    uint64_t offsets_offset;    // uint32_t[symbol_count + 2]
+    uint64_t bytes_offset;      // char[bytes_size]
+    uint64_t bytes_size;
+    uint64_t merges_offset;     // BPE_Merge[merge_count]
+    uint64_t ranks_offset;      // BPE_RankSlot[rank_capacity]
+    uint64_t chars_offset;      // BPE_CharSlot[char_capacity]
+    uint64_t trie_offset;       // BPE_TrieNode[trie_count]
+    uint64_t trie_count;
+} BPE_ModelHeader;
+
+// Trained model used by bpe_encode, loaded from a merges file or mapped from a binary model
+typedef struct {
+    int byte_level;
+    uint32_t base_count;        // base symbols take IDs 0 .. base_count - 1
+    uint32_t symbol_count;
+    uint32_t merge_count;
+    BPE_Merge *merges;
+    BPE_RankSlot *ranks;
+    uint32_t rank_capacity;     // power of two, at least twice merge_count
+    BPE_CharSlot *chars;
+    uint32_t char_capacity;     // power of two, at least twice base_count (0 in byte-level mode)
+    char *symbol_bytes;         // UTF-8 (or raw bytes) of every symbol, back to back
+    uint32_t *symbol_offsets;   // symbol i spans [offsets[i], offsets[i + 1]); entry symbol_count is BPE_UNK_TEXT
+    BPE_TrieNode *trie;         // symbol text -> ID, for lookups and greedy encoding
+    uint32_t trie_count;
+    BPE_EncodeCache *cache;     // NULL unless enabled with bpe_enable_encode_cache
+    void *mapping;              // binary model file the tables point into, NULL if they are owned
+    size_t mapping_size;
+} BPE_Model;
+
+// Persistent worker threads that run one job at a time: a function applied to items
+// 0 .. item_count - 1, handed out one by one, with the submitting thread helping
+typedef struct {
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    void (*run)(void *arg, size_t item);
+    void *arg;
+    size_t item_count;
+    size_t next_item;
+    size_t items_done;
+    int shutdown;
+} BPE_ThreadPool;
+
+// One batch-encoding task: a pre-token-aligned byte range of a document and its IDs
+typedef struct {
+    size_t doc;
+    size_t start;
+    size_t end;
+    size_t slot;                // where the range's worst case of 2 * (end - start) IDs starts in out_ids
+    uint32_t *ids;              // own buffer when the slot lies beyond cap, otherwise NULL
+    int64_t count;              // -1 if the range could not be encoded
+} BPE_BatchChunk;
+
+// IDs of one document of a batch: out_ids[offset .. offset + count), count -1 if it failed
+typedef struct {
+    size_t offset;
+    int64_t count;
+} BPE_BatchResult;
+
+// Encoder signature shared by bpe_encode and bpe_encode_greedy
+typedef int64_t (*BPE_EncodeFn)(const BPE_Model *model, const char *utf8, size_t len, uint32_t *out_ids, size_t cap);
+
+// Shared state of one bpe_encode_batch call
+typedef struct {
+    BPE_EncodeFn encode;
+    const BPE_Model *model;
+    const char *const *docs;
+    BPE_BatchChunk *chunks;
+    uint32_t *out_ids;
+    size_t cap;
+} BPE_BatchJob;
+
+// Pending merge of the symbol at pos with its successor while encoding a word
+typedef struct {
+    uint32_t rank;
+    int pos;
+} BPE_EncodeHeapEntry;
+
+SymbolEntry **symbol_table = NULL;
+char **symbol_text = NULL;                  // UTF-8 text of each symbol ID
+uint32_t symbol_count = 0;
+uint32_t symbol_capacity = 0;
+int byte_level = 0;                         // symbols start as UTF-8 bytes instead of code points
+uint32_t base_symbol_count = 0;             // symbols interned before the first merge
+BPE_Merge *merge_list = NULL;               // merges in the order they were learned
+uint32_t merge_count = 0;
+uint32_t merge_capacity = 0;
+WordSpill *word_spill = NULL;               // set while word counts spill to disk
+HeavyHitterTable *heavy_hitters = NULL;     // set while only likely-frequent words are counted
+int64_t min_token_freq = 1;                 // rarer words are pruned before subword conversion
+
+// Word delimiters (NUL included) as a byte lookup table
+const unsigned char delimiter_table[256] = {
+    ['\0'] = 1, [' '] = 1, ['.'] = 1, [','] = 1, ['!'] = 1, ['?'] = 1,
+    [';'] = 1, [':'] = 1, ['('] = 1, [')'] = 1, ['\n'] = 1,
+};
+
+// Simple lowercase mappings of Unicode 14, sorted by code point and compiled in so that
+// tokenization does not depend on the host's locale
+const CaseFoldRange case_fold_ranges[] = {
+    { 0x0041, 0x005A, 32, 1 }, { 0x00C0, 0x00D6, 32, 1 }, { 0x00D8, 0x00DE, 32, 1 }, { 0x0100, 0x012E, 1, 2 },
+    { 0x0130, 0x0130, -199, 1 }, { 0x0132, 0x0136, 1, 2 }, { 0x0139, 0x0147, 1, 2 }, { 0x014A, 0x0176, 1, 2 },
+    { 0x0178, 0x0178, -121, 1 }, { 0x0179, 0x017D, 1, 2 }, { 0x0181, 0x0181, 210, 1 }, { 0x0182, 0x0184, 1, 2 },
+    { 0x0186, 0x0186, 206, 1 }, { 0x0187, 0x0187, 1, 1 }, { 0x0189, 0x018A, 205, 1 }, { 0x018B, 0x018B, 1, 1 },
+    { 0x018E, 0x018E, 79, 1 }, { 0x018F, 0x018F, 202, 1 }, { 0x0190, 0x0190, 203, 1 }, { 0x0191, 0x0191, 1, 1 },
+    { 0x0193, 0x0193, 205, 1 }, { 0x0194, 0x0194, 207, 1 }, { 0x0196, 0x0196, 211, 1 }, { 0x0197, 0x0197, 209, 1 },
+    { 0x0198, 0x0198, 1, 1 }, { 0x019C, 0x019C, 211, 1 }, { 0x019D, 0x019D, 213, 1 }, { 0x019F, 0x019F, 214, 1 },
+    { 0x01A0, 0x01A4, 1, 2 }, { 0x01A6, 0x01A6, 218, 1 }, { 0x01A7, 0x01A7, 1, 1 }, { 0x01A9, 0x01A9, 218, 1 },
+    { 0x01AC, 0x01AC, 1, 1 }, { 0x01AE, 0x01AE, 218, 1 }, { 0x01AF, 0x01AF, 1, 1 }, { 0x01B1, 0x01B2, 217, 1 },
+    { 0x01B3, 0x01B5, 1, 2 }, { 0x01B7, 0x01B7, 219, 1 }, { 0x01B8, 0x01B8, 1, 1 }, { 0x01BC, 0x01BC, 1, 1 },
+    { 0x01C4, 0x01C4, 2, 1 }, { 0x01C5, 0x01C5, 1, 1 }, { 0x01C7, 0x01C7, 2, 1 }, { 0x01C8, 0x01C8, 1, 1 },
+    { 0x01CA, 0x01CA, 2, 1 }, { 0x01CB, 0x01DB, 1, 2 }, { 0x01DE, 0x01EE, 1, 2 }, { 0x01F1, 0x01F1, 2, 1 },
+    { 0x01F2, 0x01F4, 1, 2 }, { 0x01F6, 0x01F6, -97, 1 }, { 0x01F7, 0x01F7, -56, 1 }, { 0x01F8, 0x021E, 1, 2 },
+    { 0x0220, 0x0220, -130, 1 }, { 0x0222, 0x0232, 1, 2 }, { 0x023A, 0x023A, 10795, 1 }, { 0x023B, 0x023B, 1, 1 },
+    { 0x023D, 0x023D, -163, 1 }, { 0x023E, 0x023E, 10792, 1 }, { 0x0241, 0x0241, 1, 1 }, { 0x0243, 0x0243, -195, 1 },
+    { 0x0244, 0x0244, 69, 1 }, { 0x0245, 0x0245, 71, 1 }, { 0x0246, 0x024E, 1, 2 }, { 0x0370, 0x0372, 1, 2 },
+    { 0x0376, 0x0376, 1, 1 }, { 0x037F, 0x037F, 116, 1 }, { 0x0386, 0x0386, 38, 1 }, { 0x0388, 0x038A, 37, 1 },
+    { 0x038C, 0x038C, 64, 1 }, { 0x038E, 0x038F, 63, 1 }, { 0x0391, 0x03A1, 32, 1 }, { 0x03A3, 0x03AB, 32, 1 },
+    { 0x03CF, 0x03CF, 8, 1 }, { 0x03D8, 0x03EE, 1, 2 }, { 0x03F4, 0x03F4, -60, 1 }, { 0x03F7, 0x03F7, 1, 1 },
+    { 0x03F9, 0x03F9, -7, 1 }, { 0x03FA, 0x03FA, 1, 1 }, { 0x03FD, 0x03FF, -130, 1 }, { 0x0400, 0x040F, 80, 1 },
+    { 0x0410, 0x042F, 32, 1 }, { 0x0460, 0x0480, 1, 2 }, { 0x048A, 0x04BE, 1, 2 }, { 0x04C0, 0x04C0, 15, 1 },
+    { 0x04C1, 0x04CD, 1, 2 }, { 0x04D0, 0x052E, 1, 2 }, { 0x0531, 0x0556, 48, 1 }, { 0x10A0, 0x10C5, 7264, 1 },
+    { 0x10C7, 0x10C7, 7264, 1 }, { 0x10CD, 0x10CD, 7264, 1 }, { 0x13A0, 0x13EF, 38864, 1 }, { 0x13F0, 0x13F5, 8, 1 },
+    { 0x1C90, 0x1CBA, -3008, 1 }, { 0x1CBD, 0x1CBF, -3008, 1 }, { 0x1E00, 0x1E94, 1, 2 }, { 0x1E9E, 0x1E9E, -7615, 1 },
+    { 0x1EA0, 0x1EFE, 1, 2 }, { 0x1F08, 0x1F0F, -8, 1 }, { 0x1F18, 0x1F1D, -8, 1 }, { 0x1F28, 0x1F2F, -8, 1 },
+    { 0x1F38, 0x1F3F, -8, 1 }, { 0x1F48, 0x1F4D, -8, 1 }, { 0x1F59, 0x1F5F, -8, 2 }, { 0x1F68, 0x1F6F, -8, 1 },
+    { 0x1F88, 0x1F8F, -8, 1 }, { 0x1F98, 0x1F9F, -8, 1 }, { 0x1FA8, 0x1FAF, -8, 1 }, { 0x1FB8, 0x1FB9, -8, 1 },
+    { 0x1FBA, 0x1FBB, -74, 1 }, { 0x1FBC, 0x1FBC, -9, 1 }, { 0x1FC8, 0x1FCB, -86, 1 }, { 0x1FCC, 0x1FCC, -9, 1 },
+    { 0x1FD8, 0x1FD9, -8, 1 }, { 0x1FDA, 0x1FDB, -100, 1 }, { 0x1FE8, 0x1FE9, -8, 1 }, { 0x1FEA, 0x1FEB, -112, 1 },
+    { 0x1FEC, 0x1FEC, -7, 1 }, { 0x1FF8, 0x1FF9, -128, 1 }, { 0x1FFA, 0x1FFB, -126, 1 }, { 0x1FFC, 0x1FFC, -9, 1 },
+    { 0x2126, 0x2126, -7517, 1 }, { 0x212A, 0x212A, -8383, 1 }, { 0x212B, 0x212B, -8262, 1 }, { 0x2132, 0x2132, 28, 1 },
+    { 0x2160, 0x216F, 16, 1 }, { 0x2183, 0x2183, 1, 1 }, { 0x24B6, 0x24CF, 26, 1 }, { 0x2C00, 0x2C2F, 48, 1 },
+    { 0x2C60, 0x2C60, 1, 1 }, { 0x2C62, 0x2C62, -10743, 1 }, { 0x2C63, 0x2C63, -3814, 1 }, { 0x2C64, 0x2C64, -10727, 1 },
+    { 0x2C67, 0x2C6B, 1, 2 }, { 0x2C6D, 0x2C6D, -10780, 1 }, { 0x2C6E, 0x2C6E, -10749, 1 }, { 0x2C6F, 0x2C6F, -10783, 1 },
+    { 0x2C70, 0x2C70, -10782, 1 }, { 0x2C72, 0x2C72, 1, 1 }, { 0x2C75, 0x2C75, 1, 1 }, { 0x2C7E, 0x2C7F, -10815, 1 },
+    { 0x2C80, 0x2CE2, 1, 2 }, { 0x2CEB, 0x2CED, 1, 2 }, { 0x2CF2, 0x2CF2, 1, 1 }, { 0xA640, 0xA66C, 1, 2 },
+    { 0xA680, 0xA69A, 1, 2 }, { 0xA722, 0xA72E, 1, 2 }, { 0xA732, 0xA76E, 1, 2 }, { 0xA779, 0xA77B, 1, 2 },
+    { 0xA77D, 0xA77D, -35332, 1 }, { 0xA77E, 0xA786, 1, 2 }, { 0xA78B, 0xA78B, 1, 1 }, { 0xA78D, 0xA78D, -42280, 1 },
+    { 0xA790, 0xA792, 1, 2 }, { 0xA796, 0xA7A8, 1, 2 }, { 0xA7AA, 0xA7AA, -42308, 1 }, { 0xA7AB, 0xA7AB, -42319, 1 },
+    { 0xA7AC, 0xA7AC, -42315, 1 }, { 0xA7AD, 0xA7AD, -42305, 1 }, { 0xA7AE, 0xA7AE, -42308, 1 }, { 0xA7B0, 0xA7B0, -42258, 1 },
+    { 0xA7B1, 0xA7B1, -42282, 1 }, { 0xA7B2, 0xA7B2, -42261, 1 }, { 0xA7B3, 0xA7B3, 928, 1 }, { 0xA7B4, 0xA7C2, 1, 2 },
+    { 0xA7C4, 0xA7C4, -48, 1 }, { 0xA7C5, 0xA7C5, -42307, 1 }, { 0xA7C6, 0xA7C6, -35384, 1 }, { 0xA7C7, 0xA7C9, 1, 2 },
+    { 0xA7D0, 0xA7D0, 1, 1 }, { 0xA7D6, 0xA7D8, 1, 2 }, { 0xA7F5, 0xA7F5, 1, 1 }, { 0xFF21, 0xFF3A, 32, 1 },
+    { 0x10400, 0x10427, 40, 1 }, { 0x104B0, 0x104D3, 40, 1 }, { 0x10570, 0x1057A, 39, 1 }, { 0x1057C, 0x1058A, 39, 1 },
+    { 0x1058C, 0x10592, 39, 1 }, { 0x10594, 0x10595, 39, 1 }, { 0x10C80, 0x10CB2, 64, 1 }, { 0x118A0, 0x118BF, 32, 1 },
+    { 0x16E40, 0x16E5F, 32, 1 }, { 0x1E900, 0x1E921, 34, 1 },
+};
+
+// Lowercase mapping of the BMP, expanded once from case_fold_ranges; pages without any change
+// stay NULL
+uint16_t *case_fold_pages[CASE_FOLD_PAGES] = { NULL };
+int case_fold_ready = 0;
+
+// Classifier for DELIMITER_BLOCK bytes (bit i set when byte i is a delimiter), picked by CPU
+uint32_t (*delimiter_mask)(const char *block) = NULL;
 
 // Function prototypes
-unsigned int hash(const wchar_t *pair);
+unsigned int hash_word(const char *word, size_t len);
+int compare_bytes(const char *a, size_t a_len, const char *b, size_t b_len);
+unsigned int hash(const char *text, size_t len);
+uint64_t hash_pair_key(uint64_t key);
+size_t utf8_sequence_length(unsigned char lead);
+size_t utf8_decode(const char *s, size_t len, uint32_t *cp);
+size_t utf8_encode(uint32_t cp, char *out);
+uint32_t intern_symbol(const char *text, size_t len);
+uint32_t intern_merged_symbol(uint32_t left, uint32_t right);
+void free_symbols();
 BPE_HashMap* create_bpe_hashmap();
 void free_bpe_hashmap(BPE_HashMap *map);
-void add_pair(BPE_HashMap *map, const wchar_t *pair, uint32_t id);
-void to_lowercase(wchar_t *str);
-void add_to_vocabulary(const wchar_t *token);
-wchar_t **tokenize(const char *text, int *token_count);
-void free_tokens(wchar_t **tokens, int token_count);
-int equal_pair(const wchar_t *token1, const wchar_t *token2, const wchar_t *pair);
-void find_most_frequent_pair(BPE_HashMap *map, wchar_t *best_pair, int *best_count);
+void grow_pair_table(BPE_HashMap *map);
+uint32_t new_pair_record(BPE_HashMap *map, uint64_t key, uint32_t id);
+uint32_t intern_pair(BPE_HashMap *map, uint64_t key, uint32_t id);
+uint32_t add_pair(BPE_HashMap *map, uint64_t key, uint32_t id, int64_t weight);
+void append_pair_word(BPE_Pair *pair, uint32_t word_index);
+int compare_word_index(const void *a, const void *b);
+void init_case_fold_table();
+void free_case_fold_table();
+const CaseFoldRange *find_case_fold_range(uint32_t cp);
+uint32_t fold_code_point(uint32_t cp);
+size_t utf8_lowercase(const char *src, size_t len, char *dst, int keep_invalid);
+int is_delimiter(unsigned char c);
+uint32_t delimiter_mask_scalar(const char *block);
+#ifdef HAVE_X86_SIMD
+uint32_t delimiter_mask_sse42(const char *block);
+uint32_t delimiter_mask_avx2(const char *block);
+#endif
+void select_delimiter_kernel();
+size_t find_delimiter(const char *buf, size_t pos, size_t len);
+size_t skip_delimiters(const char *buf, size_t pos, size_t len);
+void grow_vocab_index();
+void add_word_count(const char *token, size_t len, unsigned int token_hash, int64_t freq);
+void add_to_vocabulary(const char *token, size_t len);
+int init_word_table(WordTable *table);
+void free_word_table(WordTable *table);
+void grow_word_table(WordTable *table);
+int word_table_add(WordTable *table, const char *word, size_t len, int64_t freq);
+void *count_words_worker(void *arg);
+void merge_word_table(const WordTable *table);
+int64_t count_words_parallel(const char *data, size_t size, const char *name, int num_threads);
+TokenList *tokenize(const char *text);
+void free_tokens(TokenList *tokens);
+int init_word_scanner(WordScanner *scanner);
+void free_word_scanner(WordScanner *scanner);
+int add_scanned_word(WordScanner *scanner, const char *word, size_t len, const char *name);
+int append_pending_word(WordScanner *scanner, const char *bytes, size_t len);
+int scan_words(WordScanner *scanner, const char *buf, size_t len, const char *name);
+int finish_word_scanner(WordScanner *scanner, const char *name);
+int64_t tokenize_stream(FILE *fp, const char *name);
+int64_t tokenize_file(FILE *fp, const char *name, int num_threads);
+size_t word_table_memory(const WordTable *table);
+int compare_word_count(const void *a, const void *b);
+int compare_run_words(const WordRun *a, const WordRun *b);
+FILE *open_spill_file();
+int write_word_record(FILE *fp, const char *word, uint32_t len, int64_t freq);
+int read_word_run(WordRun *run);
+void sift_run_heap(WordRun *runs, int *heap, int size, int i);
+int merge_word_runs(WordRun *runs, int run_count, FILE *out, int *dropped);
+int add_word_run(WordSpill *spill, FILE *fp);
+int spill_word_table(WordSpill *spill);
+WordSpill *create_word_spill(size_t budget, int max_runs);
+void free_word_spill(WordSpill *spill);
+int spill_word(WordSpill *spill, const char *word, size_t len);
+int absorb_word_spill(WordSpill *dst, WordSpill *src);
+int finish_word_spill(int *dropped);
+int init_heavy_hitters(int capacity);
+void sift_heavy_hitter(HeavyHitterTable *table, int pos);
+int count_heavy_hitter(const char *word, size_t len);
+int compare_heavy_hitter(const void *a, const void *b);
+int finish_heavy_hitters(int *dropped);
+int prune_vocabulary(int64_t min_freq);
+int heap_before(const BPE_HeapEntry *a, const BPE_HeapEntry *b);
+void push_pair_heap(BPE_HashMap *map, uint32_t pair);
+void pop_pair_heap(BPE_HashMap *map);
+void build_pair_heap(BPE_HashMap *map);
+uint32_t find_most_frequent_pair(BPE_HashMap *map);
+void print_symbol(FILE *fp, uint32_t symbol);
+void print_entry_text(FILE *fp, const VocabEntry *entry);
 void save_vocab();
 void save_vocab_to_file(const char *filename);
+void init_byte_symbols();
 void convert_vocab_to_subwords();
-void bpe_subword_merge(int num_merges);
+void count_word_pairs(BPE_HashMap *map, int word_index);
+void *count_pairs_worker(void *arg);
+void merge_pair_counts(BPE_HashMap *dst, BPE_HashMap *src);
+void count_all_pairs(BPE_HashMap *map, int num_threads);
+void update_pair(BPE_HashMap *map, uint32_t left, uint32_t right, uint32_t id, int64_t delta);
+void merge_word(BPE_HashMap *map, int word_index, uint32_t left, uint32_t right, uint32_t merged);
+void bpe_subword_merge(int num_merges, int num_threads);
+void record_merge(uint32_t left, uint32_t right, uint32_t merged);
+void save_merges_to_file(const char *filename);
+BPE_Model *load_bpe_model(const char *filename);
+void free_bpe_model(BPE_Model *model);
+uint64_t align_section(uint64_t offset);
+int write_section(FILE *fp, uint64_t *pos, uint64_t offset, const void *data, size_t size);
+int save_bpe_model(const BPE_Model *model, const char *filename);
+BPE_Model *map_bpe_model(const char *filename);
+BPE_Model *open_bpe_model(const char *filename);
+int build_symbol_bytes(BPE_Model *model);
+int compare_trie_key(const void *a, const void *b);
+int reserve_trie_nodes(BPE_TrieNode **trie, uint32_t *capacity, uint32_t needed);
+uint32_t find_free_slot(uint32_t *skip, uint32_t capacity, uint32_t slot);
+int build_vocab_trie(BPE_Model *model);
+uint32_t bpe_lookup_token(const BPE_Model *model, const char *text, size_t len);
+size_t bpe_longest_prefix(const BPE_Model *model, const char *text, size_t len, uint32_t *id);
+uint32_t lookup_merge_rank(const BPE_Model *model, uint32_t left, uint32_t right, uint32_t *merged);
+uint32_t lookup_base_symbol(const BPE_Model *model, uint32_t code_point);
+int encode_heap_before(const BPE_EncodeHeapEntry *a, const BPE_EncodeHeapEntry *b);
+void push_encode_heap(BPE_EncodeHeapEntry *heap, int *size, uint32_t rank, int pos);
+BPE_EncodeHeapEntry pop_encode_heap(BPE_EncodeHeapEntry *heap, int *size);
+int64_t bpe_encode_word(const BPE_Model *model, const char *word, size_t len, SymbolSlot *slots,
+                        BPE_EncodeHeapEntry *heap, uint32_t *out_ids, size_t cap);
+BPE_EncodeCache *create_encode_cache(uint32_t capacity);
+void free_encode_cache(BPE_EncodeCache *cache);
+int encode_cache_lookup(BPE_EncodeCache *cache, const char *word, size_t len, uint32_t hash, uint32_t *ids);
+void encode_cache_insert(BPE_EncodeCache *cache, const char *word, size_t len, uint32_t hash, const uint32_t *ids, int count);
+void encode_cache_stats(BPE_EncodeCache *cache, uint64_t *hits, uint64_t *misses);
+int bpe_enable_encode_cache(BPE_Model *model, uint32_t capacity);
+int64_t bpe_encode(const BPE_Model *model, const char *utf8, size_t len, uint32_t *out_ids, size_t cap);
+int64_t bpe_encode_greedy(const BPE_Model *model, const char *utf8, size_t len, uint32_t *out_ids, size_t cap);
+int64_t bpe_decode(const BPE_Model *model, const uint32_t *ids, size_t n, char *out, size_t cap);
+int check_byte_round_trip(const BPE_Model *model);
+BPE_ThreadPool *create_thread_pool(int num_threads);
+void free_thread_pool(BPE_ThreadPool *pool);
+void *thread_pool_worker(void *arg);
+void thread_pool_run(BPE_ThreadPool *pool, void (*run)(void *arg, size_t item), void *arg, size_t item_count);
+void encode_batch_chunk(void *arg, size_t item);
+int64_t bpe_encode_batch(BPE_ThreadPool *pool, BPE_EncodeFn encode, const BPE_Model *model, const char *const *docs,
+                         const size_t *lens, size_t doc_count, uint32_t *out_ids, size_t cap, BPE_BatchResult *results);
+char *read_stream(FILE *fp, size_t *len);
+int encode_files(const char *model_path, int file_count, char **paths, int num_threads, int greedy);
+int decode_files(const char *model_path, int file_count, char **paths);
+int lookup_files(const char *model_path, int file_count, char **paths);
+void print_usage(const char *prog);
 
-// Compute djb2 hash for a wide string
-unsigned int hash(const wchar_t *pair) {
+// Compute full-width djb2 hash over the bytes of a word
+unsigned int hash_word(const char *word, size_t len) {
     unsigned int hash_val = 5381;
-    while (*pair) {
-        hash_val = ((hash_val << 5) + hash_val) + *pair++;
+    for (size_t i = 0; i < len; i++) {
+        hash_val = ((hash_val << 5) + hash_val) + (unsigned char)word[i];
+    }
+    return hash_val;
+}
+
+// Order byte strings bytewise, a shorter string before any string it is a prefix of
+int compare_bytes(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int order = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (order != 0) return order;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+// Compute djb2 hash for a byte string, reduced to a bucket index
+unsigned int hash(const char *text, size_t len) {
+    return hash_word(text, len) % HASH_SIZE;
+}
+
+// Mix a packed pair key into a well-distributed 64-bit hash (MurmurHash3 finalizer)
+uint64_t hash_pair_key(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// Length of the UTF-8 sequence introduced by a lead byte (1 for stray bytes)
+size_t utf8_sequence_length(unsigned char lead) {
+    if (lead < 0xC0) return 1;
+    if (lead < 0xE0) return 2;
+    if (lead < 0xF0) return 3;
+    return 4;
+}
+
+// Decode one UTF-8 sequence; returns its length, or 0 if it is invalid or truncated
+// Overlong forms, surrogates and code points above U+10FFFF are rejected
+size_t utf8_decode(const char *s, size_t len, uint32_t *cp) {
+    const unsigned char *p = (const unsigned char *)s;
+    if (len == 0) return 0;
+    if (p[0] < 0x80) { *cp = p[0]; return 1; }
+    size_t n;
+    uint32_t c, min;
+    if (p[0] >= 0xC2 && p[0] <= 0xDF) { n = 2; c = p[0] & 0x1F; min = 0x80; }
+    else if (p[0] >= 0xE0 && p[0] <= 0xEF) { n = 3; c = p[0] & 0x0F; min = 0x800; }
+    else if (p[0] >= 0xF0 && p[0] <= 0xF4) { n = 4; c = p[0] & 0x07; min = 0x10000; }
+    else return 0;
+    if (len < n) return 0;
+    for (size_t i = 1; i < n; i++) {
+        if ((p[i] & 0xC0) != 0x80) return 0;
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return 0;
+    *cp = c;
+    return n;
+}
+
+// Encode a code point as UTF-8; returns the number of bytes written
+size_t utf8_encode(uint32_t cp, char *out) {
+    if (cp < 0x80) { out[0] = (char)cp; return 1; }
+    if (cp < 0x800) { out[0] = (char)(0xC0 | (cp >> 6)); out[1] = (char)(0x80 | (cp & 0x3F)); return 2; }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12)); out[1] = (char)(0x80 | ((cp >> 6) & 0x3F)); out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18)); out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F)); out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+// Return the ID of a symbol, interning its UTF-8 text on first sight
+uint32_t intern_symbol(const char *text, size_t len) {
+    if (!symbol_table) {
+        symbol_table = calloc(HASH_SIZE, sizeof(SymbolEntry *));
+        if (!symbol_table) { fprintf(stderr, "Error: calloc failed for symbol table\n"); exit(1); }
+    }
+    unsigned int index = hash(text, len);
+    for (SymbolEntry *entry = symbol_table[index]; entry; entry = entry->next) {
+        const char *candidate = symbol_text[entry->id];
+        if (strncmp(candidate, text, len) == 0 && candidate[len] == '\0') return entry->id;
     }
-    return hash_val % HASH_SIZE;
+    if (symbol_count == symbol_capacity) {
+        uint32_t new_capacity = symbol_capacity ? symbol_capacity * 2 : 256;
+        char **tmp = realloc(symbol_text, new_capacity * sizeof(char *));
+        if (!tmp) { fprintf(stderr, "Error: realloc failed in intern_symbol\n"); exit(1); }
+        symbol_text = tmp;
+        symbol_capacity = new_capacity;
+    }
+    SymbolEntry *entry = malloc(sizeof(SymbolEntry));
+    char *dup_text = malloc(len + 1);
+    if (!entry || !dup_text) { fprintf(stderr, "Error: malloc failed in intern_symbol\n"); exit(1); }
+    memcpy(dup_text, text, len);
+    dup_text[len] = '\0';
+    entry->id = symbol_count;
+    entry->next = symbol_table[index];
+    symbol_table[index] = entry;
+    symbol_text[symbol_count] = dup_text;
+    return symbol_count++;
+}
+
+// Intern the concatenation of two symbols
+uint32_t intern_merged_symbol(uint32_t left, uint32_t right) {
+    size_t left_len = strlen(symbol_text[left]);
+    size_t right_len = strlen(symbol_text[right]);
+    char *text = malloc(left_len + right_len + 1);
+    if (!text) { fprintf(stderr, "Error: malloc failed in intern_merged_symbol\n"); exit(1); }
+    memcpy(text, symbol_text[left], left_len);
+    memcpy(text + left_len, symbol_text[right], right_len + 1);
+    uint32_t id = intern_symbol(text, left_len + right_len);
+    free(text);
+    return id;
+}
+
+// Free the symbol table and all interned texts
+void free_symbols() {
+    if (symbol_table) {
+        for (int i = 0; i < HASH_SIZE; i++) {
+            SymbolEntry *entry = symbol_table[i];
+            while (entry) { SymbolEntry *tmp = entry; entry = entry->next; free(tmp); }
+        }
+    }
+    for (uint32_t i = 0; i < symbol_count; i++) free(symbol_text[i]);
+    free(symbol_table); free(symbol_text);
+    symbol_table = NULL; symbol_text = NULL;
+    symbol_count = symbol_capacity = 0;
 }
 
 // Create and initialize BPE hash map
 BPE_HashMap* create_bpe_hashmap() {
     BPE_HashMap *map = malloc(sizeof(BPE_HashMap));
     if (!map) { fprintf(stderr, "Error: malloc failed for BPE_HashMap\n"); exit(1); }
-    map->table = calloc(HASH_SIZE, sizeof(BPE_Pair *));
-    if (!map->table) { fprintf(stderr, "Error: calloc failed for hash table\n"); free(map); exit(1); }
-    map->mutexes = malloc(HASH_SIZE * sizeof(pthread_mutex_t));
-    if (!map->mutexes) { fprintf(stderr, "Error: malloc failed for mutexes\n"); free(map->table); free(map); exit(1); }
-    for (int i = 0; i < HASH_SIZE; i++) {
-        if (pthread_mutex_init(&map->mutexes[i], NULL) != 0) {
-            fprintf(stderr, "Error: pthread_mutex_init failed\n");
-            for (int j = 0; j < i; j++) { pthread_mutex_destroy(&map->mutexes[j]); }
-            free(map->mutexes); free(map->table); free(map); exit(1);
-        }
+    map->slots = malloc(PAIR_TABLE_INITIAL * sizeof(BPE_PairSlot));
+    if (!map->slots) { fprintf(stderr, "Error: malloc failed for hash table\n"); free(map); exit(1); }
+    for (int i = 0; i < PAIR_TABLE_INITIAL; i++) map->slots[i].index = NO_PAIR;
+    map->slot_capacity = PAIR_TABLE_INITIAL;
+    map->byte_pairs = NULL;
+    if (byte_level) {
+        map->byte_pairs = malloc(BYTE_ALPHABET * BYTE_ALPHABET * sizeof(uint32_t));
+        if (!map->byte_pairs) { fprintf(stderr, "Error: malloc failed for byte pair index\n"); exit(1); }
+        for (int i = 0; i < BYTE_ALPHABET * BYTE_ALPHABET; i++) map->byte_pairs[i] = NO_PAIR;
     }
+    map->pairs = NULL;
+    map->pair_count = 0;
+    map->pair_capacity = 0;
+    map->heap = NULL;
+    map->heap_size = 0;
+    map->heap_capacity = 0;
     return map;
 }
 
 // Free BPE hash map resources
 void free_bpe_hashmap(BPE_HashMap *map) {
-    for (int i = 0; i < HASH_SIZE; i++) {
-        pthread_mutex_destroy(&map->mutexes[i]);
-        BPE_Pair *entry = map->table[i];
-        while (entry) { BPE_Pair *tmp = entry; entry = entry->next; free(tmp); }
+    for (uint32_t i = 0; i < map->pair_count; i++) free(map->pairs[i].words);
+    free(map->heap); free(map->pairs); free(map->slots); free(map->byte_pairs); free(map);
+}
+
+// Double the slot array and reinsert every pair key
+void grow_pair_table(BPE_HashMap *map) {
+    uint32_t new_capacity = map->slot_capacity * 2;
+    BPE_PairSlot *slots = malloc(new_capacity * sizeof(BPE_PairSlot));
+    if (!slots) { fprintf(stderr, "Error: malloc failed in grow_pair_table\n"); exit(1); }
+    for (uint32_t i = 0; i < new_capacity; i++) slots[i].index = NO_PAIR;
+    for (uint32_t i = 0; i < map->slot_capacity; i++) {
+        if (map->slots[i].index == NO_PAIR) continue;
+        uint32_t slot = hash_pair_key(map->slots[i].key) & (new_capacity - 1);
+        while (slots[slot].index != NO_PAIR) slot = (slot + 1) & (new_capacity - 1);
+        slots[slot] = map->slots[i];
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->slot_capacity = new_capacity;
+}
+
+// Append an empty record for a pair that is not indexed yet
+uint32_t new_pair_record(BPE_HashMap *map, uint64_t key, uint32_t id) {
+    if (map->pair_count == map->pair_capacity) {
+        uint32_t new_capacity = map->pair_capacity ? map->pair_capacity * 2 : PAIR_TABLE_INITIAL / 2;
+        BPE_Pair *tmp = realloc(map->pairs, new_capacity * sizeof(BPE_Pair));
+        if (!tmp) { fprintf(stderr, "Error: realloc failed in intern_pair\n"); exit(1); }
+        map->pairs = tmp;
+        map->pair_capacity = new_capacity;
     }
-    free(map->mutexes); free(map->table); free(map);
+    uint32_t index = map->pair_count++;
+    BPE_Pair *pair = &map->pairs[index];
+    pair->key = key;
+    pair->count = 0;
+    pair->id = id;
+    pair->words = NULL;
+    pair->word_count = 0;
+    pair->word_capacity = 0;
+    return index;
 }
 
-// Add a BPE pair to hash map
-void add_pair(BPE_HashMap *map, const wchar_t *pair, uint32_t id) {
-    unsigned int index = hash(pair);
-    pthread_mutex_lock(&map->mutexes[index]);
-    BPE_Pair *entry = map->table[index];
-    while (entry) {
-        if (wcscmp(entry->pair, pair) == 0) { entry->count++; pthread_mutex_unlock(&map->mutexes[index]); return; }
-        entry = entry->next;
+// Return the record index of a pair, creating an empty record on first sight
+uint32_t intern_pair(BPE_HashMap *map, uint64_t key, uint32_t id) {
+    if (map->byte_pairs && PAIR_LEFT(key) < BYTE_ALPHABET && PAIR_RIGHT(key) < BYTE_ALPHABET) {
+        uint32_t *direct = &map->byte_pairs[PAIR_LEFT(key) * BYTE_ALPHABET + PAIR_RIGHT(key)];
+        if (*direct == NO_PAIR) *direct = new_pair_record(map, key, id);
+        return *direct;
+    }
+    uint32_t slot = hash_pair_key(key) & (map->slot_capacity - 1);
+    while (map->slots[slot].index != NO_PAIR) {
+        if (map->slots[slot].key == key) return map->slots[slot].index;
+        slot = (slot + 1) & (map->slot_capacity - 1);
     }
-    BPE_Pair *new_pair = malloc(sizeof(BPE_Pair));
-    if (!new_pair) { fprintf(stderr, "Error: malloc failed in add_pair\n"); pthread_mutex_unlock(&map->mutexes[index]); return; }
-    wcscpy(new_pair->pair, pair);
-    new_pair->count = 1;
-    new_pair->id = id;
-    new_pair->next = map->table[index];
-    map->table[index] = new_pair;
-    pthread_mutex_unlock(&map->mutexes[index]);
+    uint32_t index = new_pair_record(map, key, id);
+    map->slots[slot].key = key;
+    map->slots[slot].index = index;
+    if (map->pair_count * 2 > map->slot_capacity) grow_pair_table(map);
+    return index;
 }
 
-// Convert a wide string to lowercase
-void to_lowercase(wchar_t *str) {
-    for (; *str; ++str) *str = towlower(*str);
+// Add weight occurrences of a BPE pair to hash map in one update
+uint32_t add_pair(BPE_HashMap *map, uint64_t key, uint32_t id, int64_t weight) {
+    uint32_t index = intern_pair(map, key, id);
+    map->pairs[index].count += weight;
+    append_pair_word(&map->pairs[index], id);
+    return index;
 }
 
-// Add token to the vocabulary (or update frequency)
-void add_to_vocabulary(const wchar_t *token) {
-    for (int i = 0; i < vocab_size; i++) {
-        if (wcscmp(vocabulary[i].token, token) == 0) { vocabulary[i].freq++; return; }
-    }
-    if (vocab_size < MAX_VOCAB_SIZE) {
-        VocabEntry *tmp = realloc(vocabulary, (vocab_size + 1) * sizeof(VocabEntry));
-        if (!tmp) { fprintf(stderr, "Error: realloc failed in add_to_vocabulary\n"); return; }
-        vocabulary = tmp;
-        wchar_t *dup_token = wcsdup(token);
-        if (!dup_token) { fprintf(stderr, "Error: wcsdup failed in add_to_vocabulary\n"); return; }
+// Record that a word contains a pair; a word's pairs are added together, so checking
+// the last entry is enough to avoid repeats within one word
+void append_pair_word(BPE_Pair *pair, uint32_t word_index) {
+    if (pair->word_count > 0 && pair->words[pair->word_count - 1] == word_index) return;
+    if (pair->word_count == pair->word_capacity) {
+        int new_capacity = pair->word_capacity ? pair->word_capacity * 2 : 4;
+        uint32_t *tmp = realloc(pair->words, new_capacity * sizeof(uint32_t));
+        if (!tmp) { fprintf(stderr, "Error: realloc failed in append_pair_word\n"); exit(1); }
+        pair->words = tmp;
+        pair->word_capacity = new_capacity;
+    }
+    pair->words[pair->word_count++] = word_index;
+}
+
+// qsort comparator for word indices
+int compare_word_index(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Expand the BMP part of case_fold_ranges into pages of 256 code points
+void init_case_fold_table() {
+    if (case_fold_ready) return;
+    size_t range_count = sizeof(case_fold_ranges) / sizeof(case_fold_ranges[0]);
+    for (size_t i = 0; i < range_count && case_fold_ranges[i].first <= 0xFFFF; i++) {
+        const CaseFoldRange *range = &case_fold_ranges[i];
+        for (uint32_t cp = range->first; cp <= range->last; cp += range->stride) {
+            uint16_t **page = &case_fold_pages[cp >> 8];
+            if (!*page) {
+                *page = malloc(256 * sizeof(uint16_t));
+                if (!*page) { fprintf(stderr, "Error: malloc failed in init_case_fold_table\n"); exit(1); }
+                for (uint32_t low = 0; low < 256; low++) (*page)[low] = (uint16_t)((cp & ~0xFFu) | low);
+            }
+            (*page)[cp & 0xFF] = (uint16_t)(cp + range->delta);
+        }
+    }
+    case_fold_ready = 1;
+}
+
+// Free the case-folding pages
+void free_case_fold_table() {
+    for (int page = 0; page < CASE_FOLD_PAGES; page++) {
+        free(case_fold_pages[page]);
+        case_fold_pages[page] = NULL;
+    }
+    case_fold_ready = 0;
+}
+
+// Binary search for the case-folding range covering cp, NULL if there is none
+const CaseFoldRange *find_case_fold_range(uint32_t cp) {
+    size_t lo = 0, hi = sizeof(case_fold_ranges) / sizeof(case_fold_ranges[0]);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (case_fold_ranges[mid].last < cp) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == sizeof(case_fold_ranges) / sizeof(case_fold_ranges[0]) || case_fold_ranges[lo].first > cp) return NULL;
+    return &case_fold_ranges[lo];
+}
+
+// Lowercase one code point; code points above the BMP are looked up in the ranges directly
+uint32_t fold_code_point(uint32_t cp) {
+    if (cp > 0xFFFF) {
+        const CaseFoldRange *range = find_case_fold_range(cp);
+        return range && (cp - range->first) % range->stride == 0 ? cp + range->delta : cp;
+    }
+    const uint16_t *page = case_fold_pages[cp >> 8];
+    return page ? page[cp & 0xFF] : cp;
+}
+
+// Lowercase UTF-8 text into dst; ASCII runs are lowercased 16 bytes at a time and other
+// code points go through the case-folding table.
+// dst needs 2 * len bytes: lowercasing grows a code point by at most one byte.
+// Bytes that do not decode are copied as they are when keep_invalid is set (byte-level mode).
+// Returns the output length, or (size_t)-1 on invalid UTF-8 otherwise
+size_t utf8_lowercase(const char *src, size_t len, char *dst, int keep_invalid) {
+    if (!case_fold_ready) init_case_fold_table();
+    size_t in = 0, out = 0;
+    while (in < len) {
+        unsigned char c = (unsigned char)src[in];
+        if (c < 0x80) {
+#if defined(HAVE_X86_SIMD) && defined(__SSE2__)
+            const __m128i before_a = _mm_set1_epi8('A' - 1), after_z = _mm_set1_epi8('Z' + 1);
+            const __m128i case_bit = _mm_set1_epi8(0x20);
+            while (in + 16 <= len) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(src + in));
+                if (_mm_movemask_epi8(v)) break;        // block holds non-ASCII bytes
+                __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a), _mm_cmplt_epi8(v, after_z));
+                _mm_storeu_si128((__m128i *)(dst + out), _mm_or_si128(v, _mm_and_si128(upper, case_bit)));
+                in += 16;
+                out += 16;
+            }
+            if (in == len) break;
+            c = (unsigned char)src[in];
+            if (c >= 0x80) continue;
+#endif
+            dst[out++] = (char)(c >= 'A' && c <= 'Z' ? c + 0x20 : c);
+            in++;
+            continue;
+        }
+        uint32_t cp;
+        size_t n = utf8_decode(src + in, len - in, &cp);
+        if (n == 0) {
+            if (!keep_invalid) return (size_t)-1;
+            dst[out++] = src[in++];
+            continue;
+        }
+        out += utf8_encode(fold_code_point(cp), dst + out);
+        in += n;
+    }
+    return out;
+}
+
+// Check whether a byte separates words; all delimiters are ASCII, so bytes of multibyte
+// sequences never match and the input can be split without decoding it
+int is_delimiter(unsigned char c) {
+    return delimiter_table[c];
+}
+
+// Classify a block one byte at a time (portable fallback)
+uint32_t delimiter_mask_scalar(const char *block) {
+    uint32_t mask = 0;
+    for (int i = 0; i < DELIMITER_BLOCK; i++) {
+        mask |= (uint32_t)delimiter_table[(unsigned char)block[i]] << i;
+    }
+    return mask;
+}
+
+#ifdef HAVE_X86_SIMD
+// Classify a block as two 16-byte halves with PCMPESTRM against the delimiter set
+// Explicit lengths make NUL an ordinary set member rather than a terminator
+__attribute__((target("sse4.2")))
+uint32_t delimiter_mask_sse42(const char *block) {
+    const __m128i set = _mm_setr_epi8(' ', '.', ',', '!', '?', ';', ':', '(', ')', '\n', '\0', 0, 0, 0, 0, 0);
+    __m128i lo = _mm_loadu_si128((const __m128i *)block);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(block + 16));
+    uint32_t lo_mask = (uint32_t)_mm_cvtsi128_si32(_mm_cmpestrm(set, 11, lo, 16, DELIMITER_CMP_MODE)) & 0xFFFF;
+    uint32_t hi_mask = (uint32_t)_mm_cvtsi128_si32(_mm_cmpestrm(set, 11, hi, 16, DELIMITER_CMP_MODE)) & 0xFFFF;
+    return lo_mask | (hi_mask << 16);
+}
+
+// Classify a block with one 32-byte compare per delimiter
+__attribute__((target("avx2")))
+uint32_t delimiter_mask_avx2(const char *block) {
+    __m256i data = _mm256_loadu_si256((const __m256i *)block);
+    __m256i hits = _mm256_cmpeq_epi8(data, _mm256_setzero_si256());
+    static const char set[] = " .,!?;:()\n";
+    for (int i = 0; i < (int)sizeof(set) - 1; i++) {
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(data, _mm256_set1_epi8(set[i])));
+    }
+    return (uint32_t)_mm256_movemask_epi8(hits);
+}
+#endif
+
+// Pick the widest delimiter kernel the CPU supports
+void select_delimiter_kernel() {
+    delimiter_mask = delimiter_mask_scalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) delimiter_mask = delimiter_mask_avx2;
+    else if (__builtin_cpu_supports("sse4.2")) delimiter_mask = delimiter_mask_sse42;
+#endif
+}
+
+// Return the position of the first delimiter at or after pos, or len if there is none
+size_t find_delimiter(const char *buf, size_t pos, size_t len) {
+    if (!delimiter_mask) select_delimiter_kernel();
+    while (pos + DELIMITER_BLOCK <= len) {
+        uint32_t mask = delimiter_mask(buf + pos);
+        if (mask) return pos + __builtin_ctz(mask);
+        pos += DELIMITER_BLOCK;
+    }
+    while (pos < len && !delimiter_table[(unsigned char)buf[pos]]) pos++;
+    return pos;
+}
+
+// Return the position of the first non-delimiter at or after pos, or len if there is none
+size_t skip_delimiters(const char *buf, size_t pos, size_t len) {
+    if (!delimiter_mask) select_delimiter_kernel();
+    while (pos + DELIMITER_BLOCK <= len) {
+        uint32_t mask = ~delimiter_mask(buf + pos);
+        if (mask) return pos + __builtin_ctz(mask);
+        pos += DELIMITER_BLOCK;
+    }
+    while (pos < len && delimiter_table[(unsigned char)buf[pos]]) pos++;
+    return pos;
+}
+
+// Double the word index (or create it) and reinsert every vocabulary entry
+void grow_vocab_index() {
+    int new_capacity = vocab_index_capacity ? vocab_index_capacity * 2 : VOCAB_INDEX_INITIAL;
+    VocabIndexEntry *table = malloc(new_capacity * sizeof(VocabIndexEntry));
+    if (!table) { fprintf(stderr, "Error: malloc failed in grow_vocab_index\n"); exit(1); }
+    for (int i = 0; i < new_capacity; i++) table[i].index = -1;
+    for (int i = 0; i < vocab_index_capacity; i++) {
+        if (vocab_index[i].index < 0) continue;
+        unsigned int slot = vocab_index[i].hash & (new_capacity - 1);
+        while (table[slot].index >= 0) slot = (slot + 1) & (new_capacity - 1);
+        table[slot] = vocab_index[i];
+    }
+    free(vocab_index);
+    vocab_index = table;
+    vocab_index_capacity = new_capacity;
+}
+
+// Add freq occurrences of a token to the vocabulary
+// Words are found through a linear-probing hash index, so each token costs amortised O(1)
+void add_word_count(const char *token, size_t len, unsigned int token_hash, int64_t freq) {
+    if (vocab_index_capacity == 0) grow_vocab_index();
+    unsigned int slot = token_hash & (vocab_index_capacity - 1);
+    while (vocab_index[slot].index >= 0) {
+        VocabIndexEntry *probe = &vocab_index[slot];
+        const char *word = vocabulary[probe->index].token;
+        if (probe->hash == token_hash && strncmp(word, token, len) == 0 && word[len] == '\0') {
+            vocabulary[probe->index].freq += freq;
+            return;
+        }
+        slot = (slot + 1) & (vocab_index_capacity - 1);
+    }
+    if (vocab_size < vocab_limit) {
+        if (vocab_size == vocab_capacity) {
+            int new_capacity = vocab_capacity ? vocab_capacity * 2 : 256;
+            VocabEntry *tmp = realloc(vocabulary, new_capacity * sizeof(VocabEntry));
+            if (!tmp) { fprintf(stderr, "Error: realloc failed in add_to_vocabulary\n"); return; }
+            vocabulary = tmp;
+            vocab_capacity = new_capacity;
+        }
+        char *dup_token = malloc(len + 1);
+        if (!dup_token) { fprintf(stderr, "Error: malloc failed in add_to_vocabulary\n"); return; }
+        memcpy(dup_token, token, len);
+        dup_token[len] = '\0';
         vocabulary[vocab_size].token = dup_token;
         vocabulary[vocab_size].id = vocab_size;
-        vocabulary[vocab_size].freq = 1;
+        vocabulary[vocab_size].freq = freq;
+        vocabulary[vocab_size].symbols = NULL;
+        vocabulary[vocab_size].symbol_count = 0;
+        vocab_index[slot].hash = token_hash;
+        vocab_index[slot].index = vocab_size;
         vocab_size++;
+        if (vocab_size * 2 > vocab_index_capacity) grow_vocab_index();
+    }
+}
+
+// Add token to the vocabulary (or update frequency)
+void add_to_vocabulary(const char *token, size_t len) {
+    add_word_count(token, len, hash_word(token, len), 1);
+}
+
+// Prepare an empty word table
+int init_word_table(WordTable *table) {
+    table->words = NULL;
+    table->count = 0;
+    table->capacity = 0;
+    table->word_bytes = 0;
+    table->slot_capacity = VOCAB_INDEX_INITIAL;
+    table->slots = malloc(table->slot_capacity * sizeof(int));
+    if (!table->slots) { fprintf(stderr, "Error: malloc failed in init_word_table\n"); return -1; }
+    for (int i = 0; i < table->slot_capacity; i++) table->slots[i] = -1;
+    return 0;
+}
+
+// Free a word table and its words
+void free_word_table(WordTable *table) {
+    for (int i = 0; i < table->count; i++) free(table->words[i].word);
+    free(table->words);
+    free(table->slots);
+    table->words = NULL;
+    table->slots = NULL;
+    table->count = table->capacity = 0;
+}
+
+// Double the index of a word table and reinsert every word
+void grow_word_table(WordTable *table) {
+    int new_capacity = table->slot_capacity * 2;
+    int *slots = malloc(new_capacity * sizeof(int));
+    if (!slots) { fprintf(stderr, "Error: malloc failed in grow_word_table\n"); exit(1); }
+    for (int i = 0; i < new_capacity; i++) slots[i] = -1;
+    for (int i = 0; i < table->count; i++) {
+        unsigned int slot = table->words[i].hash & (new_capacity - 1);
+        while (slots[slot] >= 0) slot = (slot + 1) & (new_capacity - 1);
+        slots[slot] = i;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->slot_capacity = new_capacity;
+}
+
+// Count freq occurrences of a word in a private table (no MAX_VOCAB_SIZE cap: that applies when
+// the table is merged into the vocabulary)
+int word_table_add(WordTable *table, const char *word, size_t len, int64_t freq) {
+    unsigned int word_hash = hash_word(word, len);
+    unsigned int slot = word_hash & (table->slot_capacity - 1);
+    while (table->slots[slot] >= 0) {
+        WordCount *entry = &table->words[table->slots[slot]];
+        if (entry->hash == word_hash && entry->len == len && memcmp(entry->word, word, len) == 0) {
+            entry->freq += freq;
+            return 0;
+        }
+        slot = (slot + 1) & (table->slot_capacity - 1);
     }
+    if (table->count == table->capacity) {
+        int new_capacity = table->capacity ? table->capacity * 2 : 256;
+        WordCount *tmp = realloc(table->words, new_capacity * sizeof(WordCount));
+        if (!tmp) { fprintf(stderr, "Error: realloc failed in word_table_add\n"); return -1; }
+        table->words = tmp;
+        table->capacity = new_capacity;
+    }
+    char *dup_word = malloc(len + 1);
+    if (!dup_word) { fprintf(stderr, "Error: malloc failed in word_table_add\n"); return -1; }
+    memcpy(dup_word, word, len);
+    dup_word[len] = '\0';
+    WordCount *entry = &table->words[table->count];
+    entry->word = dup_word;
+    entry->len = len;
+    entry->hash = word_hash;
+    entry->freq = freq;
+    table->word_bytes += len + 1;
+    table->slots[slot] = table->count++;
+    if (table->count * 2 > table->slot_capacity) grow_word_table(table);
+    return 0;
 }
 
 // Tokenize input text (split by delimiters) and build initial vocabulary
-wchar_t **tokenize(const char *text, int *token_count) {
-    setlocale(LC_ALL, "en_US.UTF-8");
-    size_t req_len = mbstowcs(NULL, text, 0);
-    if (req_len == (size_t)-1) { fprintf(stderr, "Error calculating required length\n"); *token_count = 0; return NULL; }
-    wchar_t *wtext = malloc((req_len + 1) * sizeof(wchar_t));
-    if (!wtext) { fprintf(stderr, "Memory allocation failed for wide text\n"); *token_count = 0; return NULL; }
-    if (mbstowcs(wtext, text, req_len + 1) == (size_t)-1) { fprintf(stderr, "Error converting text\n"); free(wtext); *token_count = 0; return NULL; }
-
-    wchar_t **tokens = malloc(MAX_TOKENS * sizeof(wchar_t *));
-    if (!tokens) { fprintf(stderr, "Memory allocation failed for tokens array\n"); free(wtext); *token_count = 0; return NULL; }
-    for (int i = 0; i < MAX_TOKENS; i++) {
-        tokens[i] = malloc(MAX_TOKEN_LEN * sizeof(wchar_t));
-        if (!tokens[i]) {
-            fprintf(stderr, "Memory allocation failed for token %d\n", i);
-            for (int j = 0; j < i; j++) free(tokens[j]);
-            free(tokens); free(wtext); *token_count = 0;
-            return NULL;
-        }
-    }
-    const wchar_t *delims = L" .,!?;:()\n";
-    wchar_t *token = wcstok(wtext, delims, NULL);
-    int count = 0;
-    while (token && count < MAX_TOKENS) {
-        to_lowercase(token);
-        wcsncpy(tokens[count], token, MAX_TOKEN_LEN - 1);
-        tokens[count][MAX_TOKEN_LEN - 1] = L'\0';
-        add_to_vocabulary(token);
-        count++;
-        token = wcstok(NULL, delims, NULL);
-    }
-    free(wtext);
-    *token_count = count;
+// Tokens are returned as (offset, length) views into one buffer of lowercased UTF-8, so nothing
+// is allocated per token and small inputs only pay for what they contain
+TokenList *tokenize(const char *text) {
+    size_t len = strlen(text);
+    TokenList *tokens = malloc(sizeof(TokenList));
+    if (!tokens) { fprintf(stderr, "Memory allocation failed for tokens\n"); return NULL; }
+    tokens->text = malloc(2 * len + 1);
+    tokens->spans = malloc(MIN_TOKEN_SPANS * sizeof(TokenSpan));
+    tokens->count = 0;
+    tokens->capacity = MIN_TOKEN_SPANS;
+    if (!tokens->text || !tokens->spans) { fprintf(stderr, "Memory allocation failed for tokens\n"); free_tokens(tokens); return NULL; }
+
+    size_t pos = 0, out = 0;
+    while ((pos = skip_delimiters(text, pos, len)) < len) {
+        size_t start = pos;
+        pos = find_delimiter(text, pos, len);
+        if (tokens->count == tokens->capacity) {
+            TokenSpan *tmp = realloc(tokens->spans, tokens->capacity * 2 * sizeof(TokenSpan));
+            if (!tmp) { fprintf(stderr, "Memory allocation failed for token spans\n"); free_tokens(tokens); return NULL; }
+            tokens->spans = tmp;
+            tokens->capacity *= 2;
+        }
+        size_t token_len = utf8_lowercase(text + start, pos - start, tokens->text + out, byte_level);
+        if (token_len == (size_t)-1) { fprintf(stderr, "Error converting text\n"); free_tokens(tokens); return NULL; }
+        tokens->text[out + token_len] = '\0';
+        tokens->spans[tokens->count].offset = out;
+        tokens->spans[tokens->count].length = token_len;
+        tokens->count++;
+        add_to_vocabulary(tokens->text + out, token_len);
+        out += token_len + 1;
+    }
     return tokens;
 }
 
-// Free tokens array
-void free_tokens(wchar_t **tokens, int token_count) {
-    for (int i = 0; i < token_count; i++) free(tokens[i]);
+// Free tokens and the text they point into
+void free_tokens(TokenList *tokens) {
+    free(tokens->text);
+    free(tokens->spans);
     free(tokens);
 }
 
-// Check if two tokens combined (with space) equal the given pair
-int equal_pair(const wchar_t *token1, const wchar_t *token2, const wchar_t *pair) {
-    wchar_t tmp[MAX_PAIR_LEN];
-    swprintf(tmp, MAX_PAIR_LEN, L"%ls %ls", token1, token2);
-    return (wcscmp(tmp, pair) == 0);
+// Prepare a word scanner with empty buffers
+int init_word_scanner(WordScanner *scanner) {
+    scanner->table = NULL;
+    scanner->spill = word_spill;
+    scanner->word_len = 0;
+    scanner->word_capacity = MAX_TOKEN_LEN;
+    scanner->lower_capacity = 2 * MAX_TOKEN_LEN;
+    scanner->token_count = 0;
+    scanner->word = malloc(scanner->word_capacity);
+    scanner->lower = malloc(scanner->lower_capacity);
+    if (!scanner->word || !scanner->lower) { fprintf(stderr, "Memory allocation failed for word scanner\n"); free_word_scanner(scanner); return -1; }
+    return 0;
 }
 
-// Find most frequent pair in the hash map
-void find_most_frequent_pair(BPE_HashMap *map, wchar_t *best_pair, int *best_count) {
-    *best_count = 0;
-    best_pair[0] = L'\0';
-    for (int i = 0; i < HASH_SIZE; i++) {
-        BPE_Pair *entry = map->table[i];
-        while (entry) {
-            if (entry->count > *best_count) {
-                *best_count = entry->count;
-                wcscpy(best_pair, entry->pair);
-            }
-            entry = entry->next;
-        }
+// Free word scanner resources
+void free_word_scanner(WordScanner *scanner) {
+    free(scanner->word);
+    free(scanner->lower);
+    scanner->word = scanner->lower = NULL;
+}
+
+// Lowercase one complete word and add it to the vocabulary
+int add_scanned_word(WordScanner *scanner, const char *word, size_t len, const char *name) {
+    if (2 * len > scanner->lower_capacity) {
+        char *tmp = realloc(scanner->lower, 2 * len);
+        if (!tmp) { fprintf(stderr, "Memory allocation failed in add_scanned_word\n"); return -1; }
+        scanner->lower = tmp;
+        scanner->lower_capacity = 2 * len;
     }
+    size_t lower_len = utf8_lowercase(word, len, scanner->lower, byte_level);
+    if (lower_len == (size_t)-1) { fprintf(stderr, "Error converting text in %s\n", name); return -1; }
+    if (scanner->spill) {
+        if (spill_word(scanner->spill, scanner->lower, lower_len) != 0) return -1;
+    } else if (scanner->table) {
+        if (word_table_add(scanner->table, scanner->lower, lower_len, 1) != 0) return -1;
+    } else if (heavy_hitters) {
+        if (count_heavy_hitter(scanner->lower, lower_len) != 0) return -1;
+    } else add_to_vocabulary(scanner->lower, lower_len);
+    scanner->token_count++;
+    return 0;
 }
 
-// Print vocabulary to console
-void save_vocab() {
-    printf("\n[INFO] Vocabulary:\n");
-    for (int i = 0; i < vocab_size; i++) {
-        if (vocabulary[i].token != NULL) {
-            char buffer[512];
-            wcstombs(buffer, vocabulary[i].token, sizeof(buffer));
-            printf("%s (freq=%d)\n", buffer, vocabulary[i].freq);
-        } else {
-            printf("[NULL] (freq=%d)\n", vocabulary[i].freq);
-        }
+// Append bytes to the word carried over between blocks, growing its buffer as needed
+int append_pending_word(WordScanner *scanner, const char *bytes, size_t len) {
+    if (scanner->word_len + len > scanner->word_capacity) {
+        size_t new_capacity = scanner->word_capacity;
+        while (new_capacity < scanner->word_len + len) new_capacity *= 2;
+        char *tmp = realloc(scanner->word, new_capacity);
+        if (!tmp) { fprintf(stderr, "Memory allocation failed in append_pending_word\n"); return -1; }
+        scanner->word = tmp;
+        scanner->word_capacity = new_capacity;
     }
+    memcpy(scanner->word + scanner->word_len, bytes, len);
+    scanner->word_len += len;
+    return 0;
 }
 
-// Save vocabulary to file (tab-separated)
-void save_vocab_to_file(const char *filename) {
-    FILE *fp = fopen(filename, "w");
-    if (!fp) { fprintf(stderr, "Error: Could not open %s for writing\n", filename); return; }
-    for (int i = 0; i < vocab_size; i++) {
-        if (vocabulary[i].token != NULL) {
-            char buffer[512];
-            wcstombs(buffer, vocabulary[i].token, sizeof(buffer));
-            fprintf(fp, "%s\t%d\n", buffer, vocabulary[i].freq);
-        } else {
-            fprintf(fp, "[NULL]\t%d\n", vocabulary[i].freq);
+// Split one block of UTF-8 input into words and add them to the vocabulary
+// Words are taken straight from the block; one cut off at the end is carried into the next call
+int scan_words(WordScanner *scanner, const char *buf, size_t len, const char *name) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t start = pos;
+        pos = find_delimiter(buf, pos, len);
+        if (pos == len) {
+            // Word (or nothing) runs to the end of the block: keep its bytes for the next call
+            if (append_pending_word(scanner, buf + start, pos - start) != 0) return -1;
+            break;
+        }
+        if (scanner->word_len > 0) {
+            // Finish the word carried over from the previous block
+            if (append_pending_word(scanner, buf + start, pos - start) != 0) return -1;
+            size_t word_len = scanner->word_len;
+            scanner->word_len = 0;
+            if (add_scanned_word(scanner, scanner->word, word_len, name) != 0) return -1;
+        } else if (pos > start) {
+            if (add_scanned_word(scanner, buf + start, pos - start, name) != 0) return -1;
         }
+        pos++;                                  // skip the delimiter
     }
-    fclose(fp);
+    return 0;
 }
 
-// Convert vocabulary words to subword representation (insert space between characters)
-void convert_vocab_to_subwords() {
-    for (int i = 0; i < vocab_size; i++) {
-        wchar_t *word = vocabulary[i].token;
-        int len = wcslen(word);
-        int new_size = (len * 2);
-        wchar_t *new_str = malloc(new_size * sizeof(wchar_t));
-        if (!new_str) { fprintf(stderr, "Memory allocation failed in convert_vocab_to_subwords\n"); continue; }
-        int pos = 0;
-        for (int j = 0; j < len; j++) {
-            new_str[pos++] = word[j];
-            if (j < len - 1) new_str[pos++] = L' ';
-        }
-        new_str[pos] = L'\0';
-        free(vocabulary[i].token);
-        vocabulary[i].token = new_str;
+// Flush the last word at end of input
+int finish_word_scanner(WordScanner *scanner, const char *name) {
+    if (scanner->word_len == 0) return 0;
+    size_t word_len = scanner->word_len;
+    scanner->word_len = 0;
+    return add_scanned_word(scanner, scanner->word, word_len, name);
+}
+
+// Tokenize a UTF-8 stream in fixed-size chunks and add every word to the vocabulary
+// Multibyte sequences and words that straddle chunk boundaries are carried over, so memory is
+// bounded by the vocabulary and the longest word. Returns the token count, or -1 on error
+int64_t tokenize_stream(FILE *fp, const char *name) {
+    WordScanner scanner;
+    char *chunk = malloc(READ_CHUNK_SIZE);
+    if (!chunk) { fprintf(stderr, "Memory allocation failed in tokenize_stream\n"); return -1; }
+    if (init_word_scanner(&scanner) != 0) { free(chunk); return -1; }
+    int status = 0;
+    size_t n;
+    while (status == 0 && (n = fread(chunk, 1, READ_CHUNK_SIZE, fp)) > 0) {
+        status = scan_words(&scanner, chunk, n, name);
     }
+    if (status == 0 && ferror(fp)) { fprintf(stderr, "Error reading %s\n", name); status = -1; }
+    if (status == 0) status = finish_word_scanner(&scanner, name);
+    free(chunk);
+    free_word_scanner(&scanner);
+    return status == 0 ? scanner.token_count : -1;
 }
 
-// Advanced BPE merge at subword level
-void bpe_subword_merge(int num_merges) {
-    for (int merge_iter = 0; merge_iter < num_merges; merge_iter++) {
-        BPE_HashMap *map = create_bpe_hashmap();
-        // Count adjacent subword pairs over entire vocabulary
-        for (int i = 0; i < vocab_size; i++) {
-            wchar_t *word_copy = wcsdup(vocabulary[i].token);
-            if (!word_copy) continue;
-            wchar_t *symbols[256];
-            int symbol_count = 0;
-            wchar_t *token = wcstok(word_copy, L" ", NULL);
-            while (token && symbol_count < 256) {
-                symbols[symbol_count++] = token;
-                token = wcstok(NULL, L" ", NULL);
-            }
-            for (int j = 0; j < symbol_count - 1; j++) {
-                wchar_t pair[MAX_PAIR_LEN];
-                swprintf(pair, MAX_PAIR_LEN, L"%ls %ls", symbols[j], symbols[j+1]);
-                for (int k = 0; k < vocabulary[i].freq; k++) {
-                    add_pair(map, pair, i);
-                }
-            }
-            free(word_copy);
+// Thread entry point: count the words of one byte range into the task's private table
+void *count_words_worker(void *arg) {
+    WordCountTask *task = arg;
+    WordScanner scanner;
+    task->token_count = -1;
+    if (init_word_scanner(&scanner) != 0) return NULL;
+    scanner.table = &task->table;
+    scanner.spill = task->spill;
+    int status = scan_words(&scanner, task->data + task->start, task->end - task->start, task->name);
+    if (status == 0) status = finish_word_scanner(&scanner, task->name);
+    free_word_scanner(&scanner);
+    if (status == 0) task->token_count = scanner.token_count;
+    return NULL;
+}
+
+// Fold a shard's counts into the vocabulary in the shard's first-seen order
+void merge_word_table(const WordTable *table) {
+    for (int i = 0; i < table->count; i++) {
+        const WordCount *entry = &table->words[i];
+        add_word_count(entry->word, entry->len, entry->hash, entry->freq);
+    }
+}
+
+// Count the words of a mapped corpus on several threads
+// The buffer is cut into ranges that end on a delimiter, so no word spans two of them; each
+// thread counts its range into a private table and the tables are merged in range order, which
+// gives the vocabulary the same order, counts and MAX_VOCAB_SIZE cutoff as a serial scan.
+// While word counts spill to disk every thread gets a spill with an even share of the budget,
+// whose runs join the global ones for the final k-way merge
+int64_t count_words_parallel(const char *data, size_t size, const char *name, int num_threads) {
+    WordCountTask *tasks = calloc(num_threads, sizeof(WordCountTask));
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    if (!tasks || !threads) { fprintf(stderr, "Error: malloc failed in count_words_parallel\n"); free(tasks); free(threads); return -1; }
+    size_t start = 0;
+    for (int t = 0; t < num_threads; t++) {
+        size_t end = t + 1 == num_threads ? size : find_delimiter(data, size / num_threads * (t + 1), size);
+        if (end < start) end = start;
+        tasks[t].data = data;
+        tasks[t].start = start;
+        tasks[t].end = end;
+        tasks[t].name = name;
+        start = end;
+    }
+    int64_t token_count = 0;
+    for (int t = 0; t < num_threads; t++) {
+        if (init_word_table(&tasks[t].table) != 0) { token_count = -1; num_threads = t; break; }
+        if (word_spill) {
+            tasks[t].spill = create_word_spill(word_spill->budget / num_threads, SPILL_MAX_RUNS / num_threads);
+            if (!tasks[t].spill) { free_word_table(&tasks[t].table); token_count = -1; num_threads = t; break; }
         }
-        // Find the most frequent pair
-        wchar_t best_pair[MAX_PAIR_LEN];
-        int best_count = 0;
-        find_most_frequent_pair(map, best_pair, &best_count);
-        free_bpe_hashmap(map);
-        if (best_count < 1) {
-            wprintf(L"[INFO] No more pairs to merge. Stopping merges.\n");
-            break;
+        if (pthread_create(&threads[t], NULL, count_words_worker, &tasks[t]) != 0) {
+            fprintf(stderr, "Warning: pthread_create failed, counting range %d on the calling thread\n", t);
+            count_words_worker(&tasks[t]);
+            threads[t] = pthread_self();
         }
-        char best_pair_buffer[512];
-        wcstombs(best_pair_buffer, best_pair, sizeof(best_pair_buffer));
-        printf("[INFO] Subword Merge %d: Pair \"%s\" with frequency %d\n", merge_iter+1, best_pair_buffer, best_count);
-
-        // Update vocabulary by merging best_pair in each word
-        for (int i = 0; i < vocab_size; i++) {
-            wchar_t *old_token = vocabulary[i].token;
-            wchar_t new_token[MAX_TOKEN_LEN];
-            new_token[0] = L'\0';
-
-            wchar_t *copy = wcsdup(old_token);
-            if (!copy) continue;
-            wchar_t *sym = wcstok(copy, L" ", NULL);
-            int first = 1;
-            while (sym != NULL) {
-                wchar_t *next = wcstok(NULL, L" ", NULL);
-                if (next != NULL) {
-                    wchar_t tmp_pair[MAX_PAIR_LEN];
-                    swprintf(tmp_pair, MAX_PAIR_LEN, L"%ls %ls", sym, next);
-                    if (wcscmp(tmp_pair, best_pair) == 0) {
-                        wchar_t merged[MAX_TOKEN_LEN];
-                        swprintf(merged, MAX_TOKEN_LEN, L"%ls%ls", sym, next);
-                        if (!first) wcscat(new_token, L" ");
-                        wcscat(new_token, merged);
-                        first = 0;
-                        sym = wcstok(NULL, L" ", NULL);
-                        continue;
-                    }
-                }
-                if (!first) wcscat(new_token, L" ");
-                wcscat(new_token, sym);
-                first = 0;
-                sym = next;
-            }
-            free(copy);
-            wchar_t *updated = wcsdup(new_token);
-            if (updated != NULL) {
-                free(vocabulary[i].token);
-                vocabulary[i].token = updated;
-            }
+    }
+    for (int t = 0; t < num_threads; t++) {
+        if (!pthread_equal(threads[t], pthread_self())) pthread_join(threads[t], NULL);
+        if (tasks[t].token_count < 0) token_count = -1;
+        if (token_count >= 0) {
+            if (!tasks[t].spill) merge_word_table(&tasks[t].table);
+            else if (absorb_word_spill(word_spill, tasks[t].spill) != 0) token_count = -1;
+            if (token_count >= 0) token_count += tasks[t].token_count;
         }
+        free_word_table(&tasks[t].table);
+        free_word_spill(tasks[t].spill);
     }
+    free(tasks);
+    free(threads);
+    return token_count;
 }
 
-//
-// main: اجرای توکنایزر، تبدیل به زیرواژه و ادغام BPE پیشرفته و ذخیره واژگان در فایل
-//
-int main() {
-    setlocale(LC_ALL, "en_US.UTF-8");
-
-    const char *text =
-        "Although post-structuralist critiques have problematized the notion of objective epistemology, especially within the context of late modernity’s fragmented narratives, the intertextual entanglement of discourse, power, and subjectivity remains a locus of theoretical contestation. Consequently, any hermeneutic attempt at deconstructing the meta-narratives embedded within institutionalized knowledge systems necessitates a nuanced understanding of semiotic multiplicity and ontological ambiguity.";
-    
-    printf("Original text length: %zu\n\n", strlen(text));
-
-    int token_count = 0;
-    wchar_t **tokens = tokenize(text, &token_count);
-    if (!tokens) { fprintf(stderr, "Tokenization failed.\n"); return 1; }
-    printf("[INFO] Found %d tokens\n", token_count);
-    printf("[INFO] Initial Vocabulary size: %d\n", vocab_size);
+// Tokenize a corpus file, scanning it in place through mmap when it is a regular file
+// Pipes, terminals and anything mmap refuses fall back to the chunked streaming reader; large
+// mapped files are counted on up to num_threads threads unless words go to the heavy-hitter
+// counters
+int64_t tokenize_file(FILE *fp, const char *name, int num_threads) {
+    int fd = fileno(fp);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || lseek(fd, 0, SEEK_CUR) != 0) {
+        return tokenize_stream(fp, name);
+    }
+    size_t size = (size_t)st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return tokenize_stream(fp, name);
+    madvise(data, size, MADV_SEQUENTIAL);
 
-    free_tokens(tokens, token_count);
+    if (num_threads > (int)(size / MIN_BYTES_PER_THREAD)) num_threads = (int)(size / MIN_BYTES_PER_THREAD);
+    if (num_threads > 1 && !heavy_hitters) {
+        int64_t count = count_words_parallel(data, size, name, num_threads);
+        munmap(data, size);
+        return count;
+    }
 
-    save_vocab();
-    save_vocab_to_file("init_vocab.txt");
+    WordScanner scanner;
+    if (init_word_scanner(&scanner) != 0) { munmap(data, size); return -1; }
+    int status = scan_words(&scanner, data, size, name);
+    if (status == 0) status = finish_word_scanner(&scanner, name);
+    free_word_scanner(&scanner);
+    munmap(data, size);
+    return status == 0 ? scanner.token_count : -1;
+}
 
-    convert_vocab_to_subwords();
-    printf("\n[INFO] Vocabulary after conversion to subwords:\n");
-    save_vocab();
+// Estimated heap bytes of a word table
+size_t word_table_memory(const WordTable *table) {
+    return table->word_bytes + (size_t)table->capacity * sizeof(WordCount) + (size_t)table->slot_capacity * sizeof(int);
+}
 
-    bpe_subword_merge(50);
+// qsort comparator for word counts, by the bytes of their words
+int compare_word_count(const void *a, const void *b) {
+    const WordCount *x = a, *y = b;
+    return compare_bytes(x->word, x->len, y->word, y->len);
+}
 
-    printf("\n[INFO] Final Vocabulary (after subword merges):\n");
-    save_vocab();
+// Order the current records of two runs by their words
+int compare_run_words(const WordRun *a, const WordRun *b) {
+    return compare_bytes(a->word, a->len, b->word, b->len);
+}
 
-    save_vocab_to_file("vocab.txt");
-    printf("[INFO] Vocabulary saved to 'vocab.txt'\n");
+// Create an anonymous temporary file in $TMPDIR (or /tmp); it is unlinked at once, so it
+// disappears when closed or when the process dies
+FILE *open_spill_file() {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+    size_t path_len = strlen(dir) + sizeof("/bpe_words_XXXXXX");
+    char *path = malloc(path_len);
+    if (!path) { fprintf(stderr, "Error: malloc failed in open_spill_file\n"); return NULL; }
+    snprintf(path, path_len, "%s/bpe_words_XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) { fprintf(stderr, "Error: Could not create a temporary file in %s\n", dir); free(path); return NULL; }
+    unlink(path);
+    free(path);
+    FILE *fp = fdopen(fd, "w+b");
+    if (!fp) { fprintf(stderr, "Error: Could not open a temporary file in %s\n", dir); close(fd); }
+    return fp;
+}
 
-    for (int i = 0; i < vocab_size; i++) {
-        free(vocabulary[i].token);
+// Append one word count record to a run
+int write_word_record(FILE *fp, const char *word, uint32_t len, int64_t freq) {
+    if (fwrite(&len, sizeof(len), 1, fp) != 1 || fwrite(&freq, sizeof(freq), 1, fp) != 1 ||
+        fwrite(word, 1, len, fp) != len) {
+        fprintf(stderr, "Error: Could not write spilled word counts\n");
+        return -1;
     }
-    free(vocabulary);
-
     return 0;
 }
+
+// Read the next record of a run; returns 1 on a record, 0 at the end and -1 on error
+int read_word_run(WordRun *run) {
+    if (fread(&run->len, sizeof(run->len), 1, run->fp) != 1) {
+        if (ferror(run->fp)) { fprintf(stderr, "Error: Could not read spilled word counts\n"); return -1; }
+        return 0;
+    }
+    if (run->len > run->capacity) {
+        char *tmp = realloc(run->word, run->len);
+        if (!tmp) { fprintf(stderr, "Error: realloc failed in read_word_run\n"); return -1; }
+        run->word = tmp;
+        run->capacity = run->len;
+    }
+    if (fread(&run->freq, sizeof(run->freq), 1, run->fp) != 1 || fread(run->word, 1, run->len, run->fp) != run->len) {
+        fprintf(stderr, "Error: Spilled word counts are truncated\n");
+        return -1;
+    }
+    return 1;
+}
+
+// Restore the min-heap of run indices (ordered by current word) below position i
+void sift_run_heap(WordRun *runs, int *heap, int size, int i) {
+    for (;;) {
+        int smallest = i, left = 2 * i + 1, right = left + 1;
+        if (left < size && compare_run_words(&runs[heap[left]], &runs[heap[smallest]]) < 0) smallest = left;
+        if (right < size && compare_run_words(&runs[heap[right]], &runs[heap[smallest]]) < 0) smallest = right;
+        if (smallest == i) return;
+        int tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// K-way merge of sorted runs, summing the counts of equal words, into a new run or (when out is
+// NULL) into the vocabulary in byte order, where words below min_token_freq are only counted in
+// dropped. Every run is closed
+int merge_word_runs(WordRun *runs, int run_count, FILE *out, int *dropped) {
+    int *heap = malloc(run_count * sizeof(int));
+    int size = 0, status = 0;
+    if (!heap) { fprintf(stderr, "Error: malloc failed in merge_word_runs\n"); status = -1; }
+    for (int r = 0; status == 0 && r < run_count; r++) {
+        rewind(runs[r].fp);
+        int got = read_word_run(&runs[r]);
+        if (got < 0) status = -1;
+        else if (got) heap[size++] = r;
+    }
+    for (int i = size / 2 - 1; status == 0 && i >= 0; i--) sift_run_heap(runs, heap, size, i);
+    while (status == 0 && size > 0) {
+        WordRun *top = &runs[heap[0]];
+        uint32_t len = top->len;
+        int64_t freq = 0;
+        char *word = malloc(len + 1);
+        if (!word) { fprintf(stderr, "Error: malloc failed in merge_word_runs\n"); status = -1; break; }
+        memcpy(word, top->word, len);
+        word[len] = '\0';
+        // Pop every run whose current word is this one
+        while (status == 0 && size > 0 && runs[heap[0]].len == len && memcmp(runs[heap[0]].word, word, len) == 0) {
+            freq += runs[heap[0]].freq;
+            int got = read_word_run(&runs[heap[0]]);
+            if (got < 0) status = -1;
+            else if (!got) heap[0] = heap[--size];
+            if (size > 0) sift_run_heap(runs, heap, size, 0);
+        }
+        if (status == 0) {
+            if (out) status = write_word_record(out, word, len, freq);
+            else if (freq < min_token_freq) (*dropped)++;
+            else add_word_count(word, len, hash_word(word, len), freq);
+        }
+        free(word);
+    }
+    for (int r = 0; r < run_count; r++) {
+        fclose(runs[r].fp);
+        free(runs[r].word);
+    }
+    free(heap);
+    return status;
+}
+
+// Take ownership of a finished run; once max_runs runs are open they are first merged into
+// one, bounding the open files
+int add_word_run(WordSpill *spill, FILE *fp) {
+    if (spill->run_count == spill->max_runs) {
+        FILE *merged = open_spill_file();
+        if (!merged) { fclose(fp); return -1; }
+        int status = merge_word_runs(spill->runs, spill->run_count, merged, NULL);
+        spill->run_count = 0;
+        if (status != 0) { fclose(merged); fclose(fp); return -1; }
+        spill->runs[spill->run_count++] = (WordRun){ merged, NULL, 0, 0, 0 };
+    }
+    if (spill->run_count == spill->run_capacity) {
+        int new_capacity = spill->run_capacity ? spill->run_capacity * 2 : 8;
+        WordRun *tmp = realloc(spill->runs, new_capacity * sizeof(WordRun));
+        if (!tmp) { fprintf(stderr, "Error: realloc failed in add_word_run\n"); fclose(fp); return -1; }
+        spill->runs = tmp;
+        spill->run_capacity = new_capacity;
+    }
+    spill->runs[spill->run_count++] = (WordRun){ fp, NULL, 0, 0, 0 };
+    return 0;
+}
+
+// Write the spill table out as a sorted run and start an empty table
+int spill_word_table(WordSpill *spill) {
+    WordTable *table = &spill->table;
+    if (table->count == 0) return 0;
+    FILE *fp = open_spill_file();
+    if (!fp) return -1;
+    qsort(table->words, table->count, sizeof(WordCount), compare_word_count);
+    for (int i = 0; i < table->count; i++) {
+        const WordCount *entry = &table->words[i];
+        if (write_word_record(fp, entry->word, (uint32_t)entry->len, entry->freq) != 0) { fclose(fp); return -1; }
+    }
+    if (add_word_run(spill, fp) != 0) return -1;
+    spill->spilled++;
+    free_word_table(table);
+    return init_word_table(table);
+}
+
+// Create an empty spill whose table may use budget bytes and which keeps at most max_runs runs open
+WordSpill *create_word_spill(size_t budget, int max_runs) {
+    WordSpill *spill = calloc(1, sizeof(WordSpill));
+    if (!spill) { fprintf(stderr, "Error: malloc failed in create_word_spill\n"); return NULL; }
+    spill->budget = budget;
+    spill->max_runs = max_runs < 2 ? 2 : max_runs;
+    if (init_word_table(&spill->table) != 0) { free(spill); return NULL; }
+    return spill;
+}
+
+// Free a spill, closing (and so deleting) the runs it still owns
+void free_word_spill(WordSpill *spill) {
+    if (!spill) return;
+    for (int r = 0; r < spill->run_count; r++) {
+        fclose(spill->runs[r].fp);
+        free(spill->runs[r].word);
+    }
+    free_word_table(&spill->table);
+    free(spill->runs);
+    free(spill);
+}
+
+// Count one word in a spill table, spilling the table once it exceeds the budget
+int spill_word(WordSpill *spill, const char *word, size_t len) {
+    if (len > UINT32_MAX) { fprintf(stderr, "Error: Word too long to spill\n"); return -1; }
+    if (word_table_add(&spill->table, word, len, 1) != 0) return -1;
+    if (word_table_memory(&spill->table) > spill->budget) return spill_word_table(spill);
+    return 0;
+}
+
+// Move the counts of a counting thread's spill into dst and leave src empty
+// While neither has spilled, the table is folded in so first-seen order survives; otherwise
+// src's table becomes one more run and all of src's runs are handed over
+int absorb_word_spill(WordSpill *dst, WordSpill *src) {
+    if (dst->run_count == 0 && src->run_count == 0) {
+        for (int i = 0; i < src->table.count; i++) {
+            const WordCount *entry = &src->table.words[i];
+            if (word_table_add(&dst->table, entry->word, entry->len, entry->freq) != 0) return -1;
+            if (word_table_memory(&dst->table) > dst->budget && spill_word_table(dst) != 0) return -1;
+        }
+        free_word_table(&src->table);
+        return init_word_table(&src->table);
+    }
+    if (spill_word_table(src) != 0) return -1;
+    while (src->run_count > 0) {
+        WordRun *run = &src->runs[--src->run_count];
+        free(run->word);
+        if (add_word_run(dst, run->fp) != 0) return -1;
+    }
+    dst->spilled += src->spilled;
+    src->spilled = 0;
+    return 0;
+}
+
+// Move the spilled counts into the vocabulary and stop spilling
+// Without any spilled run the table is folded in first-seen order, as an in-memory count would
+// be; otherwise the runs are merged and the vocabulary comes out sorted by bytes. Words seen
+// fewer than min_token_freq times are counted in dropped instead of ever entering the vocabulary
+int finish_word_spill(int *dropped) {
+    if (!word_spill) return 0;
+    WordSpill *spill = word_spill;
+    int status = 0;
+    word_spill = NULL;
+    *dropped = 0;
+    if (spill->run_count == 0) {
+        for (int i = 0; i < spill->table.count; i++) {
+            const WordCount *entry = &spill->table.words[i];
+            if (entry->freq < min_token_freq) (*dropped)++;
+            else add_word_count(entry->word, entry->len, entry->hash, entry->freq);
+        }
+    } else {
+        status = spill_word_table(spill);
+        if (status == 0) {
+            printf("[INFO] Word counts spilled to %d sorted runs\n", spill->spilled);
+            status = merge_word_runs(spill->runs, spill->run_count, NULL, dropped);
+            spill->run_count = 0;
+        }
+    }
+    free_word_spill(spill);
+    return status;
+}
+
+// Start counting words with capacity SpaceSaving counters instead of exact counts
+int init_heavy_hitters(int capacity) {
+    heavy_hitters = calloc(1, sizeof(HeavyHitterTable));
+    if (!heavy_hitters) { fprintf(stderr, "Error: malloc failed in init_heavy_hitters\n"); return -1; }
+    unsigned int bucket_count = VOCAB_INDEX_INITIAL;
+    while (bucket_count < 2 * (unsigned int)capacity) bucket_count *= 2;
+    heavy_hitters->capacity = capacity;
+    heavy_hitters->bucket_mask = bucket_count - 1;
+    heavy_hitters->counters = malloc(capacity * sizeof(HeavyHitter));
+    heavy_hitters->heap = malloc(capacity * sizeof(int));
+    heavy_hitters->buckets = malloc(bucket_count * sizeof(int));
+    if (!heavy_hitters->counters || !heavy_hitters->heap || !heavy_hitters->buckets) {
+        fprintf(stderr, "Error: malloc failed in init_heavy_hitters\n");
+        free(heavy_hitters->counters);
+        free(heavy_hitters->heap);
+        free(heavy_hitters->buckets);
+        free(heavy_hitters);
+        heavy_hitters = NULL;
+        return -1;
+    }
+    for (unsigned int i = 0; i < bucket_count; i++) heavy_hitters->buckets[i] = -1;
+    vocab_limit = INT_MAX;
+    return 0;
+}
+
+// Move the counter at heap position pos down until no child has a smaller count
+void sift_heavy_hitter(HeavyHitterTable *table, int pos) {
+    int *heap = table->heap;
+    for (;;) {
+        int smallest = pos, left = 2 * pos + 1, right = left + 1;
+        if (left < table->count && table->counters[heap[left]].count < table->counters[heap[smallest]].count) smallest = left;
+        if (right < table->count && table->counters[heap[right]].count < table->counters[heap[smallest]].count) smallest = right;
+        if (smallest == pos) return;
+        int tmp = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = tmp;
+        table->counters[heap[pos]].heap_pos = pos;
+        table->counters[heap[smallest]].heap_pos = smallest;
+        pos = smallest;
+    }
+}
+
+// Count one occurrence of a word: bump its counter, or give it a free one, or take over the
+// counter with the smallest count
+int count_heavy_hitter(const char *word, size_t len) {
+    HeavyHitterTable *table = heavy_hitters;
+    unsigned int word_hash = hash_word(word, len);
+    int *bucket = &table->buckets[word_hash & table->bucket_mask];
+    for (int i = *bucket; i >= 0; i = table->counters[i].next) {
+        HeavyHitter *counter = &table->counters[i];
+        if (counter->hash == word_hash && counter->len == len && memcmp(counter->word, word, len) == 0) {
+            counter->count++;
+            sift_heavy_hitter(table, counter->heap_pos);
+            return 0;
+        }
+    }
+    char *dup_word = malloc(len + 1);
+    if (!dup_word) { fprintf(stderr, "Error: malloc failed in count_heavy_hitter\n"); return -1; }
+    memcpy(dup_word, word, len);
+    dup_word[len] = '\0';
+    HeavyHitter *counter;
+    if (table->count < table->capacity) {
+        // A count of 1 is the smallest there is: move parents down until it can sit at the top
+        int index = table->count++;
+        int pos = index;
+        while (pos > 0 && table->counters[table->heap[(pos - 1) / 2]].count > 1) {
+            table->heap[pos] = table->heap[(pos - 1) / 2];
+            table->counters[table->heap[pos]].heap_pos = pos;
+            pos = (pos - 1) / 2;
+        }
+        counter = &table->counters[index];
+        counter->count = 1;
+        counter->error = 0;
+        counter->heap_pos = pos;
+        table->heap[pos] = index;
+    } else {
+        int index = table->heap[0];
+        counter = &table->counters[index];
+        int *link = &table->buckets[counter->hash & table->bucket_mask];
+        while (*link != index) link = &table->counters[*link].next;
+        *link = counter->next;
+        free(counter->word);
+        counter->error = counter->count;
+        counter->count++;
+    }
+    counter->word = dup_word;
+    counter->len = len;
+    counter->hash = word_hash;
+    counter->next = *bucket;
+    *bucket = (int)(counter - table->counters);
+    sift_heavy_hitter(table, counter->heap_pos);
+    return 0;
+}
+
+// Order counters by estimated count (highest first), then by word bytes
+int compare_heavy_hitter(const void *a, const void *b) {
+    const HeavyHitter *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return compare_bytes(x->word, x->len, y->word, y->len);
+}
+
+// Move the counted words into the vocabulary, most frequent first, and stop counting
+// Words whose guaranteed count (estimate minus error) is below min_token_freq are left out and
+// counted in dropped
+int finish_heavy_hitters(int *dropped) {
+    if (!heavy_hitters) return 0;
+    HeavyHitterTable *table = heavy_hitters;
+    int kept = 0;
+    heavy_hitters = NULL;
+    qsort(table->counters, table->count, sizeof(HeavyHitter), compare_heavy_hitter);
+    for (int i = 0; i < table->count; i++) {
+        HeavyHitter *counter = &table->counters[i];
+        if (counter->count - counter->error >= min_token_freq) {
+            add_word_count(counter->word, counter->len, counter->hash, counter->count);
+            kept++;
+        }
+        free(counter->word);
+    }
+    printf("[INFO] Kept %d of %d heavy-hitter counters\n", kept, table->count);
+    *dropped = table->count - kept;
+    free(table->counters);
+    free(table->heap);
+    free(table->buckets);
+    free(table);
+    return 0;
+}
+
+// Drop words seen fewer than min_freq times before they are split into subwords, keeping the
+// rest in order under new IDs. Returns the number of words dropped
+int prune_vocabulary(int64_t min_freq) {
+    int kept = 0;
+    for (int i = 0; i < vocab_size; i++) {
+        if (vocabulary[i].freq < min_freq) { free(vocabulary[i].token); continue; }
+        vocabulary[kept] = vocabulary[i];
+        vocabulary[kept].id = kept;
+        kept++;
+    }
+    int dropped = vocab_size - kept;
+    vocab_size = kept;
+    free(vocab_index);
+    vocab_index = NULL;
+    vocab_index_capacity = 0;
+    do grow_vocab_index(); while (vocab_size * 2 > vocab_index_capacity);
+    for (int i = 0; i < vocab_size; i++) {
+        unsigned int word_hash = hash_word(vocabulary[i].token, strlen(vocabulary[i].token));
+        unsigned int slot = word_hash & (vocab_index_capacity - 1);
+        while (vocab_index[slot].index >= 0) slot = (slot + 1) & (vocab_index_capacity - 1);
+        vocab_index[slot].hash = word_hash;
+        vocab_index[slot].index = i;
+    }
+    return dropped;
+}
+
+// Order heap entries by count, then by first-seen order so ties are reproducible
+int heap_before(const BPE_HeapEntry *a, const BPE_HeapEntry *b) {
+    if (a->count != b->count) return a->count > b->count;
+    return a->pair < b->pair;
+}
+
+// Push the current count of a pair onto the max-heap
+void push_pair_heap(BPE_HashMap *map, uint32_t pair) {
+    if (map->heap_size == map->heap_capacity) {
+        int new_capacity = map->heap_capacity ? map->heap_capacity * 2 : 1024;
+        BPE_HeapEntry *tmp = realloc(map->heap, new_capacity * sizeof(BPE_HeapEntry));
+        if (!tmp) { fprintf(stderr, "Error: realloc failed in push_pair_heap\n"); exit(1); }
+        map->heap = tmp;
+        map->heap_capacity = new_capacity;
+    }
+    BPE_HeapEntry item = { map->pairs[pair].count, pair };
+    int i = map->heap_size++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!heap_before(&item, &map->heap[parent])) break;
+        map->heap[i] = map->heap[parent];
+        i = parent;
+    }
+    map->heap[i] = item;
+}
+
+// Remove the top entry of the max-heap
+void pop_pair_heap(BPE_HashMap *map) {
+    BPE_HeapEntry item = map->heap[--map->heap_size];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= map->heap_size) break;
+        if (child + 1 < map->heap_size && heap_before(&map->heap[child + 1], &map->heap[child])) child++;
+        if (!heap_before(&map->heap[child], &item)) break;
+        map->heap[i] = map->heap[child];
+        i = child;
+    }
+    if (map->heap_size > 0) map->heap[i] = item;
+}
+
+// Seed the max-heap with every pair counted so far
+void build_pair_heap(BPE_HashMap *map) {
+    for (uint32_t i = 0; i < map->pair_count; i++) {
+        if (map->pairs[i].count > 0) push_pair_heap(map, i);
+    }
+}
+
+// Find most frequent pair, discarding heap entries whose count has since changed
+// Returns NO_PAIR once no pair is left
+uint32_t find_most_frequent_pair(BPE_HashMap *map) {
+    while (map->heap_size > 0) {
+        BPE_HeapEntry *top = &map->heap[0];
+        if (top->count == map->pairs[top->pair].count) return top->pair;
+        pop_pair_heap(map);
+    }
+    return NO_PAIR;
+}
+
+// Print a symbol's text; bytes that do not form valid UTF-8 (possible in byte-level mode)
+// are written as <0xNN>
+void print_symbol(FILE *fp, uint32_t symbol) {
+    const char *text = symbol_text[symbol];
+    size_t len = strlen(text);
+    for (size_t pos = 0; pos < len;) {
+        uint32_t cp;
+        size_t n = utf8_decode(text + pos, len - pos, &cp);
+        if (n == 0) { fprintf(fp, "<0x%02X>", (unsigned char)text[pos]); pos++; continue; }
+        fwrite(text + pos, 1, n, fp);
+        pos += n;
+    }
+}
+
+// Write a vocabulary entry as text: its symbols separated by spaces once converted, else the word
+void print_entry_text(FILE *fp, const VocabEntry *entry) {
+    if (entry->symbols != NULL) {
+        for (int j = 0; j != -1 && entry->symbol_count > 0; j = entry->symbols[j].next) {
+            if (j > 0) fputc(' ', fp);
+            print_symbol(fp, entry->symbols[j].symbol);
+        }
+    } else if (entry->token != NULL) {
+        fputs(entry->token, fp);
+    } else {
+        fputs("[NULL]", fp);
+    }
+}
+
+// Print vocabulary to console
+void save_vocab() {
+    printf("\n[INFO] Vocabulary:\n");
+    for (int i = 0; i < vocab_size; i++) {
+        print_entry_text(stdout, &vocabulary[i]);
+        printf(" (freq=%" PRId64 ")\n", vocabulary[i].freq);
+    }
+}
+
+// Save vocabulary to file (tab-separated)
+void save_vocab_to_file(const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    if (!fp) { fprintf(stderr, "Error: Could not open %s for writing\n", filename); return; }
+    for (int i = 0; i < vocab_size; i++) {
+        print_entry_text(fp, &vocabulary[i]);
+        fprintf(fp, "\t%" PRId64 "\n", vocabulary[i].freq);
+    }
+    fclose(fp);
+}
+
+// Intern the 256 byte values first so that in byte-level mode a byte's symbol ID is its value
+// (NUL is a delimiter and never occurs, but keeps the range dense)
+void init_byte_symbols() {
+    for (int b = 0; b < BYTE_ALPHABET; b++) {
+        char byte = (char)b;
+        if (intern_symbol(&byte, 1) != (uint32_t)b) { fprintf(stderr, "Error: byte symbols must be interned first\n"); exit(1); }
+    }
+}
+
+// Convert vocabulary words to subword representation (one symbol ID per code point, or per
+// byte in byte-level mode). Words are valid UTF-8 by now, so each code point is just its lead
+// byte's sequence length
+void convert_vocab_to_subwords() {
+    if (byte_level) init_byte_symbols();
+    for (int i = 0; i < vocab_size; i++) {
+        const char *word = vocabulary[i].token;
+        size_t bytes = strlen(word);
+        SymbolSlot *symbols = malloc((bytes > 0 ? bytes : 1) * sizeof(SymbolSlot));
+        if (!symbols) { fprintf(stderr, "Memory allocation failed in convert_vocab_to_subwords\n"); continue; }
+        int len = 0;
+        for (size_t pos = 0; pos < bytes; len++) {
+            size_t n = byte_level ? 1 : utf8_sequence_length((unsigned char)word[pos]);
+            symbols[len].symbol = intern_symbol(word + pos, n);
+            symbols[len].prev = len - 1;
+            symbols[len].next = -1;
+            if (len > 0) symbols[len - 1].next = len;
+            pos += n;
+        }
+        free(vocabulary[i].symbols);
+        vocabulary[i].symbols = symbols;
+        vocabulary[i].symbol_count = len;
+    }
+    base_symbol_count = symbol_count;
+}
+
+// Count every adjacent pair of one word, weighted by the word frequency
+void count_word_pairs(BPE_HashMap *map, int word_index) {
+    VocabEntry *entry = &vocabulary[word_index];
+    if (entry->symbol_count < 2) return;
+    for (int j = 0; entry->symbols[j].next != -1; j = entry->symbols[j].next) {
+        SymbolSlot *slot = &entry->symbols[j];
+        add_pair(map, PAIR_KEY(slot->symbol, entry->symbols[slot->next].symbol), word_index, entry->freq);
+    }
+}
+
+// Thread entry point: count the pairs of one vocabulary slice into a private table
+void *count_pairs_worker(void *arg) {
+    PairCountTask *task = arg;
+    for (int i = task->start; i < task->end; i++) {
+        count_word_pairs(task->local, i);
+    }
+    return NULL;
+}
+
+// Fold the counts of src into dst in src's first-seen order, so dst keeps a global first-seen order
+void merge_pair_counts(BPE_HashMap *dst, BPE_HashMap *src) {
+    for (uint32_t k = 0; k < src->pair_count; k++) {
+        BPE_Pair *entry = &src->pairs[k];
+        uint32_t index = add_pair(dst, entry->key, entry->id, entry->count);
+        BPE_Pair *target = &dst->pairs[index];
+        for (int w = 1; w < entry->word_count; w++) append_pair_word(target, entry->words[w]);
+    }
+}
+
+// Count adjacent pairs over the entire vocabulary
+// Each thread counts a contiguous slice into its own table; the tables are then reduced in slice
+// order, which yields the same counts and first-seen order as a single-threaded pass
+void count_all_pairs(BPE_HashMap *map, int num_threads) {
+    if (num_threads > vocab_size / MIN_WORDS_PER_THREAD) num_threads = vocab_size / MIN_WORDS_PER_THREAD;
+    if (num_threads <= 1) {
+        for (int i = 0; i < vocab_size; i++) count_word_pairs(map, i);
+        return;
+    }
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    PairCountTask *tasks = malloc(num_threads * sizeof(PairCountTask));
+    if (!threads || !tasks) { fprintf(stderr, "Error: malloc failed in count_all_pairs\n"); exit(1); }
+    for (int t = 0; t < num_threads; t++) {
+        tasks[t].start = (int)((int64_t)vocab_size * t / num_threads);
+        tasks[t].end = (int)((int64_t)vocab_size * (t + 1) / num_threads);
+        tasks[t].local = create_bpe_hashmap();
+        if (pthread_create(&threads[t], NULL, count_pairs_worker, &tasks[t]) != 0) {
+            fprintf(stderr, "Warning: pthread_create failed, counting slice %d on the calling thread\n", t);
+            count_pairs_worker(&tasks[t]);
+            threads[t] = pthread_self();
+        }
+    }
+    for (int t = 0; t < num_threads; t++) {
+        if (!pthread_equal(threads[t], pthread_self())) pthread_join(threads[t], NULL);
+        merge_pair_counts(map, tasks[t].local);
+        free_bpe_hashmap(tasks[t].local);
+    }
+    free(tasks);
+    free(threads);
+}
+
+// Adjust the count of a pair by delta and record the new count in the heap
+// Records that drop to zero stay in the map because stale heap entries still refer to them
+void update_pair(BPE_HashMap *map, uint32_t left, uint32_t right, uint32_t id, int64_t delta) {
+    uint32_t index = intern_pair(map, PAIR_KEY(left, right), id);
+    BPE_Pair *pair = &map->pairs[index];
+    pair->count += delta;
+    if (delta > 0) append_pair_word(pair, id);
+    if (pair->count > 0) push_pair_heap(map, index);
+}
+
+// Merge every occurrence of (left, right) in one word and apply the pair-count deltas it causes
+// Each merge splices the right slot out of the list in place, with no allocation
+void merge_word(BPE_HashMap *map, int word_index, uint32_t left, uint32_t right, uint32_t merged) {
+    VocabEntry *entry = &vocabulary[word_index];
+    SymbolSlot *symbols = entry->symbols;
+    if (entry->symbol_count < 2) return;
+    int j = 0;
+    while (j != -1) {
+        int n = symbols[j].next;
+        if (n == -1 || symbols[j].symbol != left || symbols[n].symbol != right) { j = n; continue; }
+        int prev = symbols[j].prev;
+        int after = symbols[n].next;
+        // prev already holds any merge to its left, so overlapping runs stay consistent
+        update_pair(map, left, right, word_index, -entry->freq);
+        if (prev != -1) {
+            update_pair(map, symbols[prev].symbol, left, word_index, -entry->freq);
+            update_pair(map, symbols[prev].symbol, merged, word_index, entry->freq);
+        }
+        if (after != -1) {
+            update_pair(map, right, symbols[after].symbol, word_index, -entry->freq);
+            update_pair(map, merged, symbols[after].symbol, word_index, entry->freq);
+            symbols[after].prev = j;
+        }
+        symbols[j].symbol = merged;
+        symbols[j].next = after;
+        entry->symbol_count--;
+        j = after;
+    }
+}
+
+// Advanced BPE merge at subword level
+// Pair counts are built once and then kept in sync with the deltas of each merge
+void bpe_subword_merge(int num_merges, int num_threads) {
+    BPE_HashMap *map = create_bpe_hashmap();
+    count_all_pairs(map, num_threads);
+    build_pair_heap(map);
+    for (int merge_iter = 0; merge_iter < num_merges; merge_iter++) {
+        // Find the most frequent pair
+        uint32_t best_index = find_most_frequent_pair(map);
+        if (best_index == NO_PAIR) {
+            printf("[INFO] No more pairs to merge. Stopping merges.\n");
+            break;
+        }
+        BPE_Pair *best = &map->pairs[best_index];
+        uint32_t left = PAIR_LEFT(best->key);
+        uint32_t right = PAIR_RIGHT(best->key);
+        printf("[INFO] Subword Merge %d: Pair \"", merge_iter+1);
+        print_symbol(stdout, left);
+        putchar(' ');
+        print_symbol(stdout, right);
+        printf("\" with frequency %" PRId64 "\n", best->count);
+
+        // Detach the word list before merging: every occurrence is about to go, and records may
+        // move as merging inserts new pairs. The pair re-indexes words if it ever comes back
+        uint32_t *words = best->words;
+        int word_count = best->word_count;
+        best->words = NULL;
+        best->word_count = 0;
+        best->word_capacity = 0;
+
+        // Update only the words indexed under best_pair, in vocabulary order so new pairs get
+        // the same first-seen order as a full pass
+        uint32_t merged = intern_merged_symbol(left, right);
+        record_merge(left, right, merged);
+        qsort(words, word_count, sizeof(uint32_t), compare_word_index);
+        for (int k = 0; k < word_count; k++) {
+            if (k > 0 && words[k] == words[k-1]) continue;
+            merge_word(map, words[k], left, right, merged);
+        }
+        free(words);
+    }
+    free_bpe_hashmap(map);
+}
+
+// Append a merge to the learned merge list
+void record_merge(uint32_t left, uint32_t right, uint32_t merged) {
+    if (merge_count == merge_capacity) {
+        uint32_t new_capacity = merge_capacity ? merge_capacity * 2 : 256;
+        BPE_Merge *tmp = realloc(merge_list, new_capacity * sizeof(BPE_Merge));
+        if (!tmp) { fprintf(stderr, "Error: realloc failed in record_merge\n"); exit(1); }
+        merge_list = tmp;
+        merge_capacity = new_capacity;
+    }
+    merge_list[merge_count].left = left;
+    merge_list[merge_count].right = right;
+    merge_list[merge_count].merged = merged;
+    merge_count++;
+}
+
+// Save the merges in rank order, preceded by the base alphabet of a character-level run
+// Format: a "bpe-merges <version> chars|bytes <base count> <merge count>" header, one base
+// symbol per line (character mode only; the byte alphabet is implicit), then one
+// "<left> <right> <merged>" line of symbol IDs per merge
+void save_merges_to_file(const char *filename) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) { fprintf(stderr, "Error: Could not open %s for writing\n", filename); return; }
+    fprintf(fp, "bpe-merges %d %s %" PRIu32 " %" PRIu32 "\n", MERGES_FORMAT_VERSION,
+            byte_level ? "bytes" : "chars", base_symbol_count, merge_count);
+    if (!byte_level) {
+        for (uint32_t i = 0; i < base_symbol_count; i++) fprintf(fp, "%s\n", symbol_text[i]);
+    }
+    for (uint32_t k = 0; k < merge_count; k++) {
+        fprintf(fp, "%" PRIu32 " %" PRIu32 " %" PRIu32 "\n", merge_list[k].left, merge_list[k].right, merge_list[k].merged);
+    }
+    fclose(fp);
+}
+
+// Load a merges file and build its rank and base alphabet tables
+BPE_Model *load_bpe_model(const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) { fprintf(stderr, "Error: Could not open %s for reading\n", filename); return NULL; }
+    int version;
+    char mode[8];
+    uint32_t base_count, count;
+    if (fscanf(fp, "bpe-merges %d %7s %" SCNu32 " %" SCNu32, &version, mode, &base_count, &count) != 4 ||
+        version != MERGES_FORMAT_VERSION || (strcmp(mode, "chars") != 0 && strcmp(mode, "bytes") != 0) ||
+        fgetc(fp) != '\n') {
+        fprintf(stderr, "Error: %s is not a merges file\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+    BPE_Model *model = calloc(1, sizeof(BPE_Model));
+    if (!model) { fprintf(stderr, "Error: malloc failed in load_bpe_model\n"); fclose(fp); return NULL; }
+    model->byte_level = strcmp(mode, "bytes") == 0;
+    model->base_count = base_count;
+    model->symbol_count = base_count;
+    if (model->byte_level && base_count != BYTE_ALPHABET) {
+        fprintf(stderr, "Error: byte-level model %s must have %d base symbols\n", filename, BYTE_ALPHABET);
+        goto fail;
+    }
+
+    if (!model->byte_level) {
+        model->char_capacity = 16;
+        while (model->char_capacity < 2 * base_count) model->char_capacity *= 2;
+        model->chars = calloc(model->char_capacity, sizeof(BPE_CharSlot));
+        if (!model->chars) { fprintf(stderr, "Error: malloc failed in load_bpe_model\n"); goto fail; }
+        for (uint32_t i = 0; i < model->char_capacity; i++) model->chars[i].id = BPE_UNK_ID;
+        for (uint32_t i = 0; i < base_count; i++) {
+            char line[16];
+            uint32_t cp;
+            if (!fgets(line, sizeof(line), fp)) { fprintf(stderr, "Error: %s ends inside the base alphabet\n", filename); goto fail; }
+            size_t len = strcspn(line, "\n");
+            if (len == 0 || utf8_decode(line, len, &cp) != len) { fprintf(stderr, "Error: bad base symbol on line %" PRIu32 " of %s\n", i + 2, filename); goto fail; }
+            uint32_t slot = (uint32_t)hash_pair_key(cp) & (model->char_capacity - 1);
+            while (model->chars[slot].id != BPE_UNK_ID) slot = (slot + 1) & (model->char_capacity - 1);
+            model->chars[slot].code_point = cp;
+            model->chars[slot].id = i;
+        }
+    }
+
+    model->rank_capacity = 16;
+    while (model->rank_capacity < 2 * count) model->rank_capacity *= 2;
+    model->merges = malloc((count ? count : 1) * sizeof(BPE_Merge));
+    // Zeroed so empty slots are written to model.bin as zeros rather than stale heap bytes
+    model->ranks = calloc(model->rank_capacity, sizeof(BPE_RankSlot));
+    if (!model->merges || !model->ranks) { fprintf(stderr, "Error: malloc failed in load_bpe_model\n"); goto fail; }
+    for (uint32_t i = 0; i < model->rank_capacity; i++) model->ranks[i].rank = NO_PAIR;
+    for (uint32_t k = 0; k < count; k++) {
+        BPE_Merge *merge = &model->merges[k];
+        if (fscanf(fp, "%" SCNu32 " %" SCNu32 " %" SCNu32, &merge->left, &merge->right, &merge->merged) != 3 ||
+            merge->left >= model->symbol_count || merge->right >= model->symbol_count || merge->merged > model->symbol_count) {
+            fprintf(stderr, "Error: bad merge %" PRIu32 " in %s\n", k + 1, filename);
+            goto fail;
+        }
+        if (merge->merged == model->symbol_count) model->symbol_count++;
+        // A pair can be learned twice when two merges spell the same symbol; the first rank wins
+        uint64_t key = PAIR_KEY(merge->left, merge->right);
+        uint32_t slot = (uint32_t)hash_pair_key(key) & (model->rank_capacity - 1);
+        while (model->ranks[slot].rank != NO_PAIR && model->ranks[slot].key != key) slot = (slot + 1) & (model->rank_capacity - 1);
+        if (model->ranks[slot].rank != NO_PAIR) continue;
+        model->ranks[slot].key = key;
+        model->ranks[slot].rank = k;
+        model->ranks[slot].merged = merge->merged;
+    }
+    model->merge_count = count;
+    fclose(fp);
+    fp = NULL;
+    if (build_symbol_bytes(model) != 0 || build_vocab_trie(model) != 0) goto fail;
+    // Encoding may run on several threads, so resolve the lazily built tables up front
+    select_delimiter_kernel();
+    init_case_fold_table();
+    return model;
+
+fail:
+    if (fp) fclose(fp);
+    free_bpe_model(model);
+    return NULL;
+}
+
+// Free a model loaded by load_bpe_model
+void free_bpe_model(BPE_Model *model) {
+    if (!model) return;
+    free_encode_cache(model->cache);
+    if (model->mapping) {
+        munmap(model->mapping, model->mapping_size);
+        free(model);
+        return;
+    }
+    free(model->merges);
+    free(model->ranks);
+    free(model->chars);
+    free(model->symbol_bytes);
+    free(model->symbol_offsets);
+    free(model->trie);
+    free(model);
+}
+
+// Round a file offset up to the section alignment
+uint64_t align_section(uint64_t offset) {
+    return (offset + MODEL_SECTION_ALIGN - 1) & ~(uint64_t)(MODEL_SECTION_ALIGN - 1);
+}
+
+// Pad the file from *pos up to offset, then write one section
+int write_section(FILE *fp, uint64_t *pos, uint64_t offset, const void *data, size_t size) {
+    static const char padding[MODEL_SECTION_ALIGN] = { 0 };
+    if (fwrite(padding, 1, offset - *pos, fp) != offset - *pos) return -1;
+    if (size > 0 && fwrite(data, 1, size, fp) != size) return -1;
+    *pos = offset + size;
+    return 0;
+}
+
+// Write a model in the binary format read by map_bpe_model
+int save_bpe_model(const BPE_Model *model, const char *filename) {
+    BPE_ModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_FORMAT_VERSION;
+    header.byte_order = MODEL_BYTE_ORDER;
+    header.flags = model->byte_level ? MODEL_FLAG_BYTE_LEVEL : 0;
+    header.base_count = model->base_count;
+    header.symbol_count = model->symbol_count;
+    header.merge_count = model->merge_count;
+    header.rank_capacity = model->rank_capacity;
+    header.char_capacity = model->char_capacity;
+    header.bytes_size = model->symbol_offsets[model->symbol_count + 1];
+    size_t offsets_size = ((size_t)model->symbol_count + 2) * sizeof(uint32_t);
+    size_t merges_size = (size_t)model->merge_count * sizeof(BPE_Merge);
+    size_t ranks_size = (size_t)model->rank_capacity * sizeof(BPE_RankSlot);
+    size_t chars_size = (size_t)model->char_capacity * sizeof(BPE_CharSlot);
+    size_t trie_size = (size_t)model->trie_count * sizeof(BPE_TrieNode);
+    header.offsets_offset = align_section(sizeof(header));
+    header.bytes_offset = align_section(header.offsets_offset + offsets_size);
+    header.merges_offset = align_section(header.bytes_offset + header.bytes_size);
+    header.ranks_offset = align_section(header.merges_offset + merges_size);
+    header.chars_offset = align_section(header.ranks_offset + ranks_size);
+    header.trie_offset = align_section(header.chars_offset + chars_size);
+    header.trie_count = model->trie_count;
+    header.file_size = header.trie_offset + trie_size;
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) { fprintf(stderr, "Error: Could not open %s for writing\n", filename); return -1; }
+    uint64_t pos = 0;
+    int status = write_section(fp, &pos, 0, &header, sizeof(header));
+    if (status == 0) status = write_section(fp, &pos, header.offsets_offset, model->symbol_offsets, offsets_size);
+    if (status == 0) status = write_section(fp, &pos, header.bytes_offset, model->symbol_bytes, header.bytes_size);
+    if (status == 0) status = write_section(fp, &pos, header.merges_offset, model->merges, merges_size);
+    if (status == 0) status = write_section(fp, &pos, header.ranks_offset, model->ranks, ranks_size);
+    if (status == 0) status = write_section(fp, &pos, header.chars_offset, model->chars, chars_size);
+    if (status == 0) status = write_section(fp, &pos, header.trie_offset, model->trie, trie_size);
+    if (fclose(fp) != 0) status = -1;
+    if (status != 0) fprintf(stderr, "Error: failed writing %s\n", filename);
+    return status;
+}
+
+// Map a binary model read-only and point the tables into the mapping
+// Only the structure is checked (header, section bounds, table sizes), so opening costs the
+// same for any vocabulary size and the pages are shared by every process mapping the file
+BPE_Model *map_bpe_model(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { fprintf(stderr, "Error: Could not open %s for reading\n", filename); return NULL; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BPE_ModelHeader)) {
+        fprintf(stderr, "Error: %s is not a valid model file\n", filename);
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { fprintf(stderr, "Error: Could not map %s\n", filename); return NULL; }
+
+    const BPE_ModelHeader *header = data;
+    uint64_t size = (uint64_t)st.st_size;
+    int valid = memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version == MODEL_FORMAT_VERSION && header->byte_order == MODEL_BYTE_ORDER &&
+        header->file_size == size &&
+        header->offsets_offset % MODEL_SECTION_ALIGN == 0 && header->merges_offset % MODEL_SECTION_ALIGN == 0 &&
+        header->ranks_offset % MODEL_SECTION_ALIGN == 0 && header->chars_offset % MODEL_SECTION_ALIGN == 0 &&
+        header->offsets_offset + ((uint64_t)header->symbol_count + 2) * sizeof(uint32_t) <= size &&
+        header->bytes_offset + header->bytes_size <= size &&
+        header->merges_offset + (uint64_t)header->merge_count * sizeof(BPE_Merge) <= size &&
+        header->ranks_offset + (uint64_t)header->rank_capacity * sizeof(BPE_RankSlot) <= size &&
+        header->chars_offset + (uint64_t)header->char_capacity * sizeof(BPE_CharSlot) <= size &&
+        header->trie_offset % MODEL_SECTION_ALIGN == 0 && header->trie_count > 0 && header->trie_count <= INT32_MAX &&
+        header->trie_offset + header->trie_count * sizeof(BPE_TrieNode) <= size &&
+        header->base_count <= header->symbol_count &&
+        header->symbol_count - header->base_count <= header->merge_count &&
+        // The probe loops stop only at an empty slot, so the tables must be at most half full
+        header->rank_capacity > 0 && (header->rank_capacity & (header->rank_capacity - 1)) == 0 &&
+        header->rank_capacity >= 2 * (uint64_t)header->merge_count &&
+        (header->flags & MODEL_FLAG_BYTE_LEVEL ? header->base_count == BYTE_ALPHABET
+                                               : header->char_capacity > 0 && (header->char_capacity & (header->char_capacity - 1)) == 0 &&
+                                                 header->char_capacity >= 2 * (uint64_t)header->base_count);
+    const uint32_t *offsets = (const uint32_t *)((const char *)data + (valid ? header->offsets_offset : 0));
+    if (valid && (offsets[header->symbol_count] > offsets[header->symbol_count + 1] ||
+                  offsets[header->symbol_count + 1] > header->bytes_size)) valid = 0;
+    if (!valid) {
+        fprintf(stderr, "Error: %s is not a valid model file\n", filename);
+        munmap(data, (size_t)size);
+        return NULL;
+    }
+
+    BPE_Model *model = calloc(1, sizeof(BPE_Model));
+    if (!model) { fprintf(stderr, "Error: malloc failed in map_bpe_model\n"); munmap(data, (size_t)size); return NULL; }
+    char *base = data;
+    model->byte_level = (header->flags & MODEL_FLAG_BYTE_LEVEL) != 0;
+    model->base_count = header->base_count;
+    model->symbol_count = header->symbol_count;
+    model->merge_count = header->merge_count;
+    model->merges = (BPE_Merge *)(base + header->merges_offset);
+    model->ranks = (BPE_RankSlot *)(base + header->ranks_offset);
+    model->rank_capacity = header->rank_capacity;
+    model->chars = header->char_capacity ? (BPE_CharSlot *)(base + header->chars_offset) : NULL;
+    model->char_capacity = header->char_capacity;
+    model->symbol_bytes = base + header->bytes_offset;
+    model->symbol_offsets = (uint32_t *)(base + header->offsets_offset);
+    model->trie = (BPE_TrieNode *)(base + header->trie_offset);
+    model->trie_count = (uint32_t)header->trie_count;
+    model->mapping = data;
+    model->mapping_size = (size_t)size;
+    select_delimiter_kernel();
+    init_case_fold_table();
+    return model;
+}
+
+// Open a model in either format: binary files start with MODEL_MAGIC, anything else is
+// read as a merges file
+BPE_Model *open_bpe_model(const char *filename) {
+    char magic[sizeof(MODEL_MAGIC) - 1];
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) { fprintf(stderr, "Error: Could not open %s for reading\n", filename); return NULL; }
+    int binary = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, MODEL_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+    return binary ? map_bpe_model(filename) : load_bpe_model(filename);
+}
+
+// Lay out the bytes of every symbol in ID order: base symbols first, then each merge that
+// created a new ID as the concatenation of its (earlier) halves
+int build_symbol_bytes(BPE_Model *model) {
+    uint32_t count = model->symbol_count;
+    model->symbol_offsets = malloc((count + 2) * sizeof(uint32_t));
+    if (!model->symbol_offsets) { fprintf(stderr, "Error: malloc failed in build_symbol_bytes\n"); return -1; }
+    uint32_t *offsets = model->symbol_offsets;
+
+    // Pass 1: lengths, stored one slot ahead so the prefix sum turns them into offsets
+    char utf8[4];
+    if (model->byte_level) {
+        for (uint32_t i = 0; i < model->base_count; i++) offsets[i + 1] = 1;
+    } else {
+        for (uint32_t i = 0; i < model->char_capacity; i++) {
+            if (model->chars[i].id != BPE_UNK_ID) offsets[model->chars[i].id + 1] = (uint32_t)utf8_encode(model->chars[i].code_point, utf8);
+        }
+    }
+    uint32_t next_id = model->base_count;
+    for (uint32_t k = 0; k < model->merge_count && next_id < count; k++) {
+        const BPE_Merge *merge = &model->merges[k];
+        if (merge->merged != next_id) continue;
+        uint64_t len = (uint64_t)offsets[merge->left + 1] + offsets[merge->right + 1];
+        if (len > UINT32_MAX) { fprintf(stderr, "Error: symbol %" PRIu32 " is too long\n", next_id); return -1; }
+        offsets[++next_id] = (uint32_t)len;
+    }
+    offsets[count + 1] = sizeof(BPE_UNK_TEXT) - 1;
+    offsets[0] = 0;
+    for (uint32_t i = 1; i <= count + 1; i++) {
+        if ((uint64_t)offsets[i - 1] + offsets[i] > UINT32_MAX) { fprintf(stderr, "Error: symbol table exceeds 4 GiB\n"); return -1; }
+        offsets[i] += offsets[i - 1];
+    }
+
+    // Pass 2: bytes
+    model->symbol_bytes = malloc(offsets[count + 1] ? offsets[count + 1] : 1);
+    if (!model->symbol_bytes) { fprintf(stderr, "Error: malloc failed in build_symbol_bytes\n"); return -1; }
+    char *bytes = model->symbol_bytes;
+    if (model->byte_level) {
+        for (uint32_t i = 0; i < model->base_count; i++) bytes[offsets[i]] = (char)i;
+    } else {
+        for (uint32_t i = 0; i < model->char_capacity; i++) {
+            if (model->chars[i].id != BPE_UNK_ID) utf8_encode(model->chars[i].code_point, bytes + offsets[model->chars[i].id]);
+        }
+    }
+    next_id = model->base_count;
+    for (uint32_t k = 0; k < model->merge_count && next_id < count; k++) {
+        const BPE_Merge *merge = &model->merges[k];
+        if (merge->merged != next_id) continue;
+        uint32_t left_len = offsets[merge->left + 1] - offsets[merge->left];
+        memcpy(bytes + offsets[next_id], bytes + offsets[merge->left], left_len);
+        memcpy(bytes + offsets[next_id] + left_len, bytes + offsets[merge->right], offsets[merge->right + 1] - offsets[merge->right]);
+        next_id++;
+    }
+    memcpy(bytes + offsets[count], BPE_UNK_TEXT, sizeof(BPE_UNK_TEXT) - 1);
+    return 0;
+}
+
+// Order trie keys bytewise, shorter keys first among equal prefixes
+int compare_trie_key(const void *a, const void *b) {
+    const BPE_TrieKey *x = a, *y = b;
+    return compare_bytes(x->text, x->len, y->text, y->len);
+}
+
+// Grow the node array so that index needed - 1 exists; new nodes are free
+int reserve_trie_nodes(BPE_TrieNode **trie, uint32_t *capacity, uint32_t needed) {
+    if (needed <= *capacity) return 0;
+    if (needed > INT32_MAX) { fprintf(stderr, "Error: trie exceeds %d nodes\n", INT32_MAX); return -1; }
+    uint32_t new_capacity = *capacity ? *capacity : 1024;
+    while (new_capacity < needed) new_capacity = new_capacity > INT32_MAX / 2 ? INT32_MAX : new_capacity * 2;
+    BPE_TrieNode *tmp = realloc(*trie, new_capacity * sizeof(BPE_TrieNode));
+    if (!tmp) { fprintf(stderr, "Error: realloc failed in reserve_trie_nodes\n"); return -1; }
+    for (uint32_t i = *capacity; i < new_capacity; i++) {
+        tmp[i].base = 0;
+        tmp[i].check = -1;
+        tmp[i].value = BPE_UNK_ID;
+    }
+    *trie = tmp;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Return the first free slot at or after slot; skip[i] == i marks a free slot and used slots
+// point further right, compressed as they are followed (slots past capacity are all free)
+uint32_t find_free_slot(uint32_t *skip, uint32_t capacity, uint32_t slot) {
+    uint32_t root = slot;
+    while (root < capacity && skip[root] != root) root = skip[root];
+    while (slot < capacity && skip[slot] != slot) {
+        uint32_t next = skip[slot];
+        skip[slot] = root;
+        slot = next;
+    }
+    return root;
+}
+
+// Build a double-array trie over the text of every symbol
+// Keys are sorted so each node's children come from one contiguous range; a node's base is the
+// first offset at which all of its child slots are free, found by walking only free slots
+int build_vocab_trie(BPE_Model *model) {
+    uint32_t count = model->symbol_count;
+    BPE_TrieKey *keys = malloc((count ? count : 1) * sizeof(BPE_TrieKey));
+    BPE_TrieBuildItem *stack = malloc(((size_t)count + 1) * sizeof(BPE_TrieBuildItem));
+    BPE_TrieNode *trie = NULL;
+    uint32_t *skip = NULL;
+    uint32_t capacity = 0, skip_capacity = 0, used = 1;
+    int status = -1;
+    if (!keys || !stack) { fprintf(stderr, "Error: malloc failed in build_vocab_trie\n"); goto done; }
+    for (uint32_t i = 0; i < count; i++) {
+        keys[i].text = model->symbol_bytes + model->symbol_offsets[i];
+        keys[i].len = model->symbol_offsets[i + 1] - model->symbol_offsets[i];
+        keys[i].id = i;
+    }
+    qsort(keys, count, sizeof(BPE_TrieKey), compare_trie_key);
+    if (reserve_trie_nodes(&trie, &capacity, 1) != 0) goto done;
+    trie[0].check = -2;                         // the root has no parent but is not free
+    skip = malloc(capacity * sizeof(uint32_t));
+    if (!skip) { fprintf(stderr, "Error: malloc failed in build_vocab_trie\n"); goto done; }
+    skip_capacity = capacity;
+    for (uint32_t i = 0; i < capacity; i++) skip[i] = i;
+    skip[0] = 1;
+
+    // Every node on the stack owns a distinct, non-empty set of keys, so it never holds more
+    // than count + 1 items
+    int stack_size = 0;
+    stack[stack_size++] = (BPE_TrieBuildItem){ 0, 0, count, 0 };
+    while (stack_size > 0) {
+        BPE_TrieBuildItem item = stack[--stack_size];
+        uint32_t lo = item.lo;
+        if (lo < item.hi && keys[lo].len == item.depth) trie[item.node].value = keys[lo++].id;
+        if (lo == item.hi) continue;
+
+        // Group the keys by their next byte, then find a base where every child slot is free
+        uint32_t starts[BYTE_ALPHABET + 1];
+        unsigned char labels[BYTE_ALPHABET];
+        int child_count = 0;
+        for (uint32_t k = lo; k < item.hi; k++) {
+            unsigned char c = (unsigned char)keys[k].text[item.depth];
+            if (child_count == 0 || labels[child_count - 1] != c) {
+                labels[child_count] = c;
+                starts[child_count++] = k;
+            }
+        }
+        starts[child_count] = item.hi;
+        uint32_t base;
+        for (uint32_t slot = find_free_slot(skip, skip_capacity, labels[0] + 2); ; slot = find_free_slot(skip, skip_capacity, slot + 1)) {
+            base = slot - labels[0] - 1;
+            int fits = 1;
+            for (int j = 1; j < child_count && fits; j++) {
+                uint32_t other = base + labels[j] + 1;
+                if (other < capacity && trie[other].check != -1) fits = 0;
+            }
+            if (fits) break;
+        }
+        if (reserve_trie_nodes(&trie, &capacity, base + BYTE_ALPHABET + 1) != 0) goto done;
+        if (skip_capacity < capacity) {
+            uint32_t *tmp = realloc(skip, capacity * sizeof(uint32_t));
+            if (!tmp) { fprintf(stderr, "Error: realloc failed in build_vocab_trie\n"); goto done; }
+            skip = tmp;
+            for (uint32_t i = skip_capacity; i < capacity; i++) skip[i] = i;
+            skip_capacity = capacity;
+        }
+        trie[item.node].base = (int32_t)base;
+        for (int j = 0; j < child_count; j++) {
+            uint32_t child = base + labels[j] + 1;
+            trie[child].check = (int32_t)item.node;
+            skip[child] = child + 1;
+            if (child + 1 > used) used = child + 1;
+            stack[stack_size++] = (BPE_TrieBuildItem){ child, starts[j], starts[j + 1], item.depth + 1 };
+        }
+    }
+    BPE_TrieNode *tmp = realloc(trie, used * sizeof(BPE_TrieNode));
+    model->trie = tmp ? tmp : trie;
+    model->trie_count = used;
+    trie = NULL;
+    status = 0;
+done:
+    free(trie);
+    free(skip);
+    free(keys);
+    free(stack);
+    return status;
+}
+
+// Return the ID of the symbol spelled exactly by text, or BPE_UNK_ID if it is not in the vocabulary
+uint32_t bpe_lookup_token(const BPE_Model *model, const char *text, size_t len) {
+    const BPE_TrieNode *trie = model->trie;
+    uint32_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint32_t child = (uint32_t)trie[node].base + (unsigned char)text[i] + 1;
+        if (child >= model->trie_count || trie[child].check != (int32_t)node) return BPE_UNK_ID;
+        node = child;
+    }
+    return trie[node].value;
+}
+
+// Find the longest symbol that is a prefix of text; returns its length (0 if none) and ID
+size_t bpe_longest_prefix(const BPE_Model *model, const char *text, size_t len, uint32_t *id) {
+    const BPE_TrieNode *trie = model->trie;
+    uint32_t node = 0;
+    size_t best = 0;
+    *id = BPE_UNK_ID;
+    for (size_t i = 0; i < len; i++) {
+        uint32_t child = (uint32_t)trie[node].base + (unsigned char)text[i] + 1;
+        if (child >= model->trie_count || trie[child].check != (int32_t)node) break;
+        node = child;
+        if (trie[node].value != BPE_UNK_ID) {
+            best = i + 1;
+            *id = trie[node].value;
+        }
+    }
+    return best;
+}
+
+// Return the rank of merging left with right (and the merged symbol), or NO_PAIR
+uint32_t lookup_merge_rank(const BPE_Model *model, uint32_t left, uint32_t right, uint32_t *merged) {
+    uint64_t key = PAIR_KEY(left, right);
+    uint32_t slot = (uint32_t)hash_pair_key(key) & (model->rank_capacity - 1);
+    while (model->ranks[slot].rank != NO_PAIR) {
+        if (model->ranks[slot].key == key) {
+            *merged = model->ranks[slot].merged;
+            return model->ranks[slot].rank;
+        }
+        slot = (slot + 1) & (model->rank_capacity - 1);
+    }
+    return NO_PAIR;
+}
+
+// Return the base symbol of a code point in a character-level model, or BPE_UNK_ID
+uint32_t lookup_base_symbol(const BPE_Model *model, uint32_t code_point) {
+    uint32_t slot = (uint32_t)hash_pair_key(code_point) & (model->char_capacity - 1);
+    while (model->chars[slot].id != BPE_UNK_ID) {
+        if (model->chars[slot].code_point == code_point) return model->chars[slot].id;
+        slot = (slot + 1) & (model->char_capacity - 1);
+    }
+    return BPE_UNK_ID;
+}
+
+// Order encode heap entries by rank, leftmost first among equal ranks
+int encode_heap_before(const BPE_EncodeHeapEntry *a, const BPE_EncodeHeapEntry *b) {
+    return a->rank != b->rank ? a->rank < b->rank : a->pos < b->pos;
+}
+
+// Push a candidate merge onto a word's min-heap
+void push_encode_heap(BPE_EncodeHeapEntry *heap, int *size, uint32_t rank, int pos) {
+    int i = (*size)++;
+    BPE_EncodeHeapEntry entry = { rank, pos };
+    while (i > 0 && encode_heap_before(&entry, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = entry;
+}
+
+// Remove and return the lowest-ranked candidate
+BPE_EncodeHeapEntry pop_encode_heap(BPE_EncodeHeapEntry *heap, int *size) {
+    BPE_EncodeHeapEntry top = heap[0];
+    BPE_EncodeHeapEntry last = heap[--(*size)];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= *size) break;
+        if (child + 1 < *size && encode_heap_before(&heap[child + 1], &heap[child])) child++;
+        if (!encode_heap_before(&heap[child], &last)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (*size > 0) heap[i] = last;
+    return top;
+}
+
+// Encode one lowercased word: split it into base symbols, then repeatedly apply the
+// lowest-ranked merge among adjacent pairs, as training did
+// slots and heap need room for len and 3 * len entries. Returns the number of IDs, or -1
+// if they do not fit in cap
+int64_t bpe_encode_word(const BPE_Model *model, const char *word, size_t len, SymbolSlot *slots,
+                        BPE_EncodeHeapEntry *heap, uint32_t *out_ids, size_t cap) {
+    int n = 0;
+    for (size_t pos = 0; pos < len; n++) {
+        if (model->byte_level) {
+            slots[n].symbol = (unsigned char)word[pos++];
+        } else {
+            uint32_t cp;
+            pos += utf8_decode(word + pos, len - pos, &cp);
+            slots[n].symbol = lookup_base_symbol(model, cp);
+        }
+        slots[n].prev = n - 1;
+        slots[n].next = -1;
+        if (n > 0) slots[n - 1].next = n;
+    }
+
+    int heap_size = 0;
+    uint32_t merged;
+    for (int j = 0; j + 1 < n; j++) {
+        uint32_t rank = lookup_merge_rank(model, slots[j].symbol, slots[j + 1].symbol, &merged);
+        if (rank != NO_PAIR) push_encode_heap(heap, &heap_size, rank, j);
+    }
+    while (heap_size > 0) {
+        BPE_EncodeHeapEntry top = pop_encode_heap(heap, &heap_size);
+        SymbolSlot *slot = &slots[top.pos];
+        // Skip candidates whose slot was merged away or whose pair changed since the push
+        if (slot->next == -1) continue;
+        if (lookup_merge_rank(model, slot->symbol, slots[slot->next].symbol, &merged) != top.rank) continue;
+        int right = slot->next;
+        slot->symbol = merged;
+        slot->next = slots[right].next;
+        if (slot->next != -1) slots[slot->next].prev = top.pos;
+        slots[right].next = -1;
+        uint32_t rank;
+        if (slot->prev != -1 && (rank = lookup_merge_rank(model, slots[slot->prev].symbol, slot->symbol, &merged)) != NO_PAIR) {
+            push_encode_heap(heap, &heap_size, rank, slot->prev);
+        }
+        if (slot->next != -1 && (rank = lookup_merge_rank(model, slot->symbol, slots[slot->next].symbol, &merged)) != NO_PAIR) {
+            push_encode_heap(heap, &heap_size, rank, top.pos);
+        }
+    }
+
+    size_t count = 0;
+    for (int j = 0; j != -1; j = slots[j].next) {
+        if (count == cap) return -1;
+        out_ids[count++] = slots[j].symbol;
+    }
+    return (int64_t)count;
+}
+
+// Create an encode cache holding up to capacity words, split evenly over the stripes
+BPE_EncodeCache *create_encode_cache(uint32_t capacity) {
+    BPE_EncodeCache *cache = calloc(1, sizeof(BPE_EncodeCache));
+    if (!cache) { fprintf(stderr, "Error: malloc failed in create_encode_cache\n"); return NULL; }
+    uint32_t per_stripe = capacity / ENCODE_CACHE_STRIPES > 0 ? capacity / ENCODE_CACHE_STRIPES : 1;
+    uint32_t bucket_count = 1;
+    while (bucket_count < 2 * per_stripe) bucket_count *= 2;
+    for (int s = 0; s < ENCODE_CACHE_STRIPES; s++) {
+        BPE_CacheStripe *stripe = &cache->stripes[s];
+        pthread_mutex_init(&stripe->lock, NULL);
+        stripe->entries = malloc(per_stripe * sizeof(BPE_CacheEntry));
+        stripe->buckets = malloc(bucket_count * sizeof(int32_t));
+        if (!stripe->entries || !stripe->buckets) { fprintf(stderr, "Error: malloc failed in create_encode_cache\n"); free_encode_cache(cache); return NULL; }
+        for (uint32_t b = 0; b < bucket_count; b++) stripe->buckets[b] = -1;
+        stripe->bucket_mask = bucket_count - 1;
+        stripe->capacity = per_stripe;
+    }
+    return cache;
+}
+
+// Free an encode cache
+void free_encode_cache(BPE_EncodeCache *cache) {
+    if (!cache) return;
+    for (int s = 0; s < ENCODE_CACHE_STRIPES; s++) {
+        pthread_mutex_destroy(&cache->stripes[s].lock);
+        free(cache->stripes[s].entries);
+        free(cache->stripes[s].buckets);
+    }
+    free(cache);
+}
+
+// Copy the cached IDs of a word into ids (room for ENCODE_CACHE_IDS_MAX); returns their
+// count, or -1 on a miss
+int encode_cache_lookup(BPE_EncodeCache *cache, const char *word, size_t len, uint32_t hash, uint32_t *ids) {
+    BPE_CacheStripe *stripe = &cache->stripes[hash % ENCODE_CACHE_STRIPES];
+    int count = -1;
+    pthread_mutex_lock(&stripe->lock);
+    for (int32_t e = stripe->buckets[(hash / ENCODE_CACHE_STRIPES) & stripe->bucket_mask]; e != -1; e = stripe->entries[e].next) {
+        BPE_CacheEntry *entry = &stripe->entries[e];
+        if (entry->hash == hash && entry->word_len == len && memcmp(entry->word, word, len) == 0) {
+            entry->referenced = 1;
+            count = entry->id_count;
+            memcpy(ids, entry->ids, count * sizeof(uint32_t));
+            break;
+        }
+    }
+    if (count < 0) stripe->misses++;
+    else stripe->hits++;
+    pthread_mutex_unlock(&stripe->lock);
+    return count;
+}
+
+// Cache the IDs of a word, evicting with CLOCK once the stripe is full
+// The caller checks the size limits; a word another thread cached meanwhile is left as is
+void encode_cache_insert(BPE_EncodeCache *cache, const char *word, size_t len, uint32_t hash, const uint32_t *ids, int count) {
+    BPE_CacheStripe *stripe = &cache->stripes[hash % ENCODE_CACHE_STRIPES];
+    uint32_t bucket = (hash / ENCODE_CACHE_STRIPES) & stripe->bucket_mask;
+    pthread_mutex_lock(&stripe->lock);
+    for (int32_t e = stripe->buckets[bucket]; e != -1; e = stripe->entries[e].next) {
+        BPE_CacheEntry *entry = &stripe->entries[e];
+        if (entry->hash == hash && entry->word_len == len && memcmp(entry->word, word, len) == 0) {
+            pthread_mutex_unlock(&stripe->lock);
+            return;
+        }
+    }
+    uint32_t victim;
+    if (stripe->count < stripe->capacity) {
+        victim = stripe->count++;
+    } else {
+        // Sweep past recently hit entries, clearing their bit, and unlink the first cold one
+        while (stripe->entries[stripe->hand].referenced) {
+            stripe->entries[stripe->hand].referenced = 0;
+            stripe->hand = (stripe->hand + 1) % stripe->capacity;
+        }
+        victim = stripe->hand;
+        stripe->hand = (stripe->hand + 1) % stripe->capacity;
+        int32_t *link = &stripe->buckets[(stripe->entries[victim].hash / ENCODE_CACHE_STRIPES) & stripe->bucket_mask];
+        while (*link != (int32_t)victim) link = &stripe->entries[*link].next;
+        *link = stripe->entries[victim].next;
+    }
+    BPE_CacheEntry *entry = &stripe->entries[victim];
+    entry->hash = hash;
+    entry->word_len = (uint8_t)len;
+    entry->id_count = (uint8_t)count;
+    entry->referenced = 0;
+    memcpy(entry->word, word, len);
+    memcpy(entry->ids, ids, count * sizeof(uint32_t));
+    entry->next = stripe->buckets[bucket];
+    stripe->buckets[bucket] = (int32_t)victim;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+// Sum the hit and miss counters of all stripes
+void encode_cache_stats(BPE_EncodeCache *cache, uint64_t *hits, uint64_t *misses) {
+    *hits = *misses = 0;
+    for (int s = 0; s < ENCODE_CACHE_STRIPES; s++) {
+        pthread_mutex_lock(&cache->stripes[s].lock);
+        *hits += cache->stripes[s].hits;
+        *misses += cache->stripes[s].misses;
+        pthread_mutex_unlock(&cache->stripes[s].lock);
+    }
+}
+
+// Attach a word cache of the given capacity to a model; call before encoding starts
+int bpe_enable_encode_cache(BPE_Model *model, uint32_t capacity) {
+    free_encode_cache(model->cache);
+    model->cache = create_encode_cache(capacity);
+    return model->cache ? 0 : -1;
+}
+
+// Encode UTF-8 text into symbol IDs with a trained model
+// Text is pre-tokenized like the training input (split on delimiters, which produce no IDs,
+// and lowercased). Characters outside a character-level alphabet become BPE_UNK_ID.
+// At most 2 * len IDs are produced. Scratch space is sized by the longest word, not by len.
+// Returns the number of IDs written, or -1 if they do not fit in cap or the text is not valid UTF-8
+int64_t bpe_encode(const BPE_Model *model, const char *utf8, size_t len, uint32_t *out_ids, size_t cap) {
+    char *lower = NULL;
+    SymbolSlot *slots = NULL;
+    BPE_EncodeHeapEntry *heap = NULL;
+    size_t scratch = 0;                         // longest word the buffers have room for
+    int64_t count = 0;
+    size_t pos = 0;
+    while (count >= 0 && (pos = skip_delimiters(utf8, pos, len)) < len) {
+        size_t start = pos;
+        pos = find_delimiter(utf8, pos, len);
+        if (pos - start > scratch) {
+            scratch = scratch ? scratch * 2 : MAX_TOKEN_LEN;
+            if (scratch < pos - start) scratch = pos - start;
+            char *new_lower = realloc(lower, 2 * scratch);
+            if (new_lower) lower = new_lower;
+            SymbolSlot *new_slots = realloc(slots, 2 * scratch * sizeof(SymbolSlot));
+            if (new_slots) slots = new_slots;
+            BPE_EncodeHeapEntry *new_heap = realloc(heap, 6 * scratch * sizeof(BPE_EncodeHeapEntry));
+            if (new_heap) heap = new_heap;
+            if (!new_lower || !new_slots || !new_heap) { fprintf(stderr, "Error: malloc failed in bpe_encode\n"); count = -1; break; }
+        }
+        size_t lower_len = utf8_lowercase(utf8 + start, pos - start, lower, model->byte_level);
+        if (lower_len == (size_t)-1) { count = -1; break; }
+        // Short words go through the cache; only misses run the merge heap
+        int cacheable = model->cache && lower_len <= ENCODE_CACHE_WORD_MAX;
+        uint32_t word_hash = cacheable ? (uint32_t)hash_pair_key(hash_word(lower, lower_len)) : 0;
+        if (cacheable) {
+            uint32_t cached[ENCODE_CACHE_IDS_MAX];
+            int n = encode_cache_lookup(model->cache, lower, lower_len, word_hash, cached);
+            if (n >= 0) {
+                if ((size_t)n > cap - (size_t)count) { count = -1; break; }
+                memcpy(out_ids + count, cached, n * sizeof(uint32_t));
+                count += n;
+                continue;
+            }
+        }
+        int64_t n = bpe_encode_word(model, lower, lower_len, slots, heap, out_ids + count, cap - (size_t)count);
+        if (n < 0) { count = -1; break; }
+        if (cacheable && n <= ENCODE_CACHE_IDS_MAX) encode_cache_insert(model->cache, lower, lower_len, word_hash, out_ids + count, (int)n);
+        count += n;
+    }
+    free(lower);
+    free(slots);
+    free(heap);
+    return count;
+}
+
+// Decode symbol IDs back into bytes by copying each symbol's span of the byte table
+// IDs outside the model (BPE_UNK_ID included) decode as U+FFFD; nothing is inserted between
+// words. Returns the number of bytes written (no terminator), or -1 if they do not fit in cap
+int64_t bpe_decode(const BPE_Model *model, const uint32_t *ids, size_t n, char *out, size_t cap) {
+    const uint32_t *offsets = model->symbol_offsets;
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t id = ids[i] < model->symbol_count ? ids[i] : model->symbol_count;
+        uint32_t len = offsets[id + 1] - offsets[id];
+        if (len > cap - written) return -1;
+        memcpy(out + written, model->symbol_bytes + offsets[id], len);
+        written += len;
+    }
+    return (int64_t)written;
+}
+
+// Check that a byte-level model encodes and decodes back every byte that is not valid UTF-8
+// on its own; each one is put between ASCII letters so none of them can form a sequence
+int check_byte_round_trip(const BPE_Model *model) {
+    char text[256], decoded[256];
+    uint32_t ids[2 * sizeof(text) + 1];
+    size_t len = 0;
+    for (int b = 0x80; b <= 0xFF; b++) {
+        text[len++] = 'a';
+        text[len++] = (char)b;
+    }
+    int64_t count = bpe_encode(model, text, len, ids, sizeof(ids) / sizeof(ids[0]));
+    int64_t written = count < 0 ? -1 : bpe_decode(model, ids, (size_t)count, decoded, sizeof(decoded));
+    if (written != (int64_t)len || memcmp(decoded, text, len) != 0) {
+        fprintf(stderr, "Error: byte-level model does not round-trip invalid UTF-8\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Start a pool of num_threads - 1 workers; the thread submitting a job is the last one
+BPE_ThreadPool *create_thread_pool(int num_threads) {
+    BPE_ThreadPool *pool = calloc(1, sizeof(BPE_ThreadPool));
+    if (!pool) { fprintf(stderr, "Error: malloc failed in create_thread_pool\n"); return NULL; }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    int workers = num_threads > 1 ? num_threads - 1 : 0;
+    pool->threads = malloc((workers > 0 ? workers : 1) * sizeof(pthread_t));
+    if (!pool->threads) { fprintf(stderr, "Error: malloc failed in create_thread_pool\n"); free_thread_pool(pool); return NULL; }
+    for (int t = 0; t < workers; t++) {
+        if (pthread_create(&pool->threads[t], NULL, thread_pool_worker, pool) != 0) {
+            fprintf(stderr, "Warning: pthread_create failed, pool runs with %d workers\n", t);
+            break;
+        }
+        pool->thread_count++;
+    }
+    return pool;
+}
+
+// Stop and join the workers, then free the pool
+void free_thread_pool(BPE_ThreadPool *pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 0; t < pool->thread_count; t++) pthread_join(pool->threads[t], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->threads);
+    free(pool);
+}
+
+// Worker loop: take items of the current job until the pool shuts down
+void *thread_pool_worker(void *arg) {
+    BPE_ThreadPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->next_item >= pool->item_count) pthread_cond_wait(&pool->work_ready, &pool->lock);
+        if (pool->shutdown) break;
+        size_t item = pool->next_item++;
+        void (*run)(void *, size_t) = pool->run;
+        void *job = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+        run(job, item);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->items_done == pool->item_count) pthread_cond_signal(&pool->work_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Run a job to completion on the pool and the calling thread
+// Jobs on one pool must not overlap: submit the next one after this returns
+void thread_pool_run(BPE_ThreadPool *pool, void (*run)(void *arg, size_t item), void *arg, size_t item_count) {
+    if (!pool) {
+        for (size_t item = 0; item < item_count; item++) run(arg, item);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->run = run;
+    pool->arg = arg;
+    pool->item_count = item_count;
+    pool->next_item = 0;
+    pool->items_done = 0;
+    pthread_cond_broadcast(&pool->work_ready);
+    while (pool->next_item < pool->item_count) {
+        size_t item = pool->next_item++;
+        pthread_mutex_unlock(&pool->lock);
+        run(arg, item);
+        pthread_mutex_lock(&pool->lock);
+        pool->items_done++;
+    }
+    while (pool->items_done < pool->item_count) pthread_cond_wait(&pool->work_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Pool job: encode one chunk into its own buffer
+void encode_batch_chunk(void *arg, size_t item) {
+    BPE_BatchJob *job = arg;
+    BPE_BatchChunk *chunk = &job->chunks[item];
+    size_t len = chunk->end - chunk->start;
+    uint32_t *ids = job->out_ids + chunk->slot;
+    if (len == 0) { chunk->count = 0; return; }
+    if (chunk->slot > job->cap || 2 * len > job->cap - chunk->slot) {
+        ids = chunk->ids = malloc(2 * len * sizeof(uint32_t));
+        if (!ids) { fprintf(stderr, "Error: malloc failed in encode_batch_chunk\n"); chunk->count = -1; return; }
+    }
+    chunk->count = job->encode(job->model, job->docs[chunk->doc] + chunk->start, len, ids, 2 * len);
+}
+
+// Encode a batch of documents on a thread pool (NULL runs on the calling thread) with encode
+// (bpe_encode when NULL)
+// Documents are split at pre-token boundaries into chunks of about BATCH_CHUNK_BYTES, so one
+// large document spreads over the pool too. Each chunk encodes straight into out_ids at the
+// position its worst case would reach, and the chunks are then moved down to close the gaps;
+// with cap of at least 2 * (sum of lens) no other buffer is needed. results[d] tells where the
+// IDs of document d are, or that it could not be encoded (not valid UTF-8).
+// Returns the total number of IDs, or -1 if they do not fit in cap or memory runs out
+int64_t bpe_encode_batch(BPE_ThreadPool *pool, BPE_EncodeFn encode, const BPE_Model *model, const char *const *docs,
+                         const size_t *lens, size_t doc_count, uint32_t *out_ids, size_t cap, BPE_BatchResult *results) {
+    size_t chunk_count = 0, chunk_capacity = doc_count + 16, slot = 0;
+    BPE_BatchChunk *chunks = malloc(chunk_capacity * sizeof(BPE_BatchChunk));
+    if (!chunks) { fprintf(stderr, "Error: malloc failed in bpe_encode_batch\n"); return -1; }
+    for (size_t d = 0; d < doc_count; d++) {
+        size_t start = 0;
+        do {
+            size_t end = lens[d] - start > BATCH_CHUNK_BYTES ? find_delimiter(docs[d], start + BATCH_CHUNK_BYTES, lens[d]) : lens[d];
+            if (chunk_count == chunk_capacity) {
+                BPE_BatchChunk *tmp = realloc(chunks, chunk_capacity * 2 * sizeof(BPE_BatchChunk));
+                if (!tmp) { fprintf(stderr, "Error: realloc failed in bpe_encode_batch\n"); free(chunks); return -1; }
+                chunks = tmp;
+                chunk_capacity *= 2;
+            }
+            chunks[chunk_count].doc = d;
+            chunks[chunk_count].start = start;
+            chunks[chunk_count].end = end;
+            chunks[chunk_count].slot = slot;
+            chunks[chunk_count].ids = NULL;
+            chunk_count++;
+            slot += 2 * (end - start);
+            start = end;
+        } while (start < lens[d]);
+    }
+
+    BPE_BatchJob job = { encode ? encode : bpe_encode, model, docs, chunks, out_ids, cap };
+    thread_pool_run(pool, encode_batch_chunk, &job, chunk_count);
+
+    // Close the gaps in chunk order; IDs only move down, and a chunk never reaches past its own
+    // slot, so nothing is overwritten before it is moved. A failed chunk drops its whole document
+    int64_t total = 0;
+    for (size_t c = 0; c < chunk_count; c++) {
+        BPE_BatchChunk *chunk = &chunks[c];
+        BPE_BatchResult *result = &results[chunk->doc];
+        if (chunk->start == 0) {
+            result->offset = total < 0 ? 0 : (size_t)total;
+            result->count = 0;
+        }
+        if (total >= 0 && result->count >= 0) {
+            if (chunk->count < 0) {
+                total = (int64_t)result->offset;
+                result->count = -1;
+            } else if ((size_t)chunk->count > cap - (size_t)total) {
+                total = -1;
+            } else {
+                memmove(out_ids + total, chunk->ids ? chunk->ids : out_ids + chunk->slot, chunk->count * sizeof(uint32_t));
+                total += chunk->count;
+                result->count += chunk->count;
+            }
+        }
+        free(chunk->ids);
+    }
+    free(chunks);
+    return total;
+}
+
+// Encode UTF-8 text by greedy longest match against the vocabulary trie
+// Faster than bpe_encode but not identical to it: a longest match can cut across the merges
+// bpe_encode would apply. Pre-tokenization, UNK handling and return values are the same
+int64_t bpe_encode_greedy(const BPE_Model *model, const char *utf8, size_t len, uint32_t *out_ids, size_t cap) {
+    char *lower = NULL;
+    size_t lower_capacity = 0;
+    int64_t count = 0;
+    size_t pos = 0;
+    while (count >= 0 && (pos = skip_delimiters(utf8, pos, len)) < len) {
+        size_t start = pos;
+        pos = find_delimiter(utf8, pos, len);
+        if (2 * (pos - start) > lower_capacity) {
+            lower_capacity = lower_capacity ? lower_capacity * 2 : 2 * MAX_TOKEN_LEN;
+            if (lower_capacity < 2 * (pos - start)) lower_capacity = 2 * (pos - start);
+            char *tmp = realloc(lower, lower_capacity);
+            if (!tmp) { fprintf(stderr, "Error: malloc failed in bpe_encode_greedy\n"); count = -1; break; }
+            lower = tmp;
+        }
+        size_t lower_len = utf8_lowercase(utf8 + start, pos - start, lower, model->byte_level);
+        if (lower_len == (size_t)-1) { count = -1; break; }
+        for (size_t at = 0; at < lower_len; ) {
+            if ((size_t)count == cap) { count = -1; break; }
+            uint32_t id;
+            size_t match = bpe_longest_prefix(model, lower + at, lower_len - at, &id);
+            // Nothing matches only for a character outside the alphabet: emit UNK and skip it
+            if (match == 0) match = utf8_sequence_length((unsigned char)lower[at]);
+            out_ids[count++] = id;
+            at += match;
+        }
+    }
+    free(lower);
+    return count;
+}
+
+// Read a whole stream into a NUL-terminated buffer
+char *read_stream(FILE *fp, size_t *len) {
+    size_t capacity = READ_CHUNK_SIZE, size = 0;
+    char *buf = malloc(capacity + 1);
+    if (!buf) { fprintf(stderr, "Error: malloc failed in read_stream\n"); return NULL; }
+    size_t n;
+    while ((n = fread(buf + size, 1, capacity - size, fp)) > 0) {
+        size += n;
+        if (size == capacity) {
+            char *tmp = realloc(buf, capacity * 2 + 1);
+            if (!tmp) { fprintf(stderr, "Error: realloc failed in read_stream\n"); free(buf); return NULL; }
+            buf = tmp;
+            capacity *= 2;
+        }
+    }
+    if (ferror(fp)) { fprintf(stderr, "Error: read failed\n"); free(buf); return NULL; }
+    buf[size] = '\0';
+    *len = size;
+    return buf;
+}
+
+// Encode the files (stdin when none are given) as one batch and print the IDs of each on a line
+int encode_files(const char *model_path, int file_count, char **paths, int num_threads, int greedy) {
+    char *stdin_path[] = { "-" };
+    if (file_count == 0) { file_count = 1; paths = stdin_path; }
+    char **docs = calloc(file_count, sizeof(char *));
+    size_t *lens = calloc(file_count, sizeof(size_t));
+    BPE_BatchResult *results = malloc(file_count * sizeof(BPE_BatchResult));
+    if (!docs || !lens || !results) { fprintf(stderr, "Error: malloc failed in encode_files\n"); free(docs); free(lens); free(results); return 1; }
+    int status = 0;
+    size_t cap = 1;
+    for (int i = 0; i < file_count && status == 0; i++) {
+        int use_stdin = strcmp(paths[i], "-") == 0;
+        FILE *fp = use_stdin ? stdin : fopen(paths[i], "rb");
+        if (!fp) { fprintf(stderr, "Error: Could not open %s for reading\n", paths[i]); status = 1; break; }
+        docs[i] = read_stream(fp, &lens[i]);
+        if (!use_stdin) fclose(fp);
+        if (!docs[i]) status = 1;
+        cap += 2 * lens[i];
+    }
+
+    BPE_Model *model = status == 0 ? open_bpe_model(model_path) : NULL;
+    BPE_ThreadPool *pool = model ? create_thread_pool(num_threads) : NULL;
+    uint32_t *ids = pool ? malloc(cap * sizeof(uint32_t)) : NULL;
+    if (!ids || bpe_enable_encode_cache(model, ENCODE_CACHE_CAPACITY) != 0) status = 1;
+    if (status == 0) {
+        if (bpe_encode_batch(pool, greedy ? bpe_encode_greedy : bpe_encode, model, (const char *const *)docs, lens,
+                             file_count, ids, cap, results) < 0) {
+            fprintf(stderr, "Error: could not encode the input\n");
+            status = 1;
+        } else {
+            // A document that failed still gets its (empty) line, so lines match the inputs
+            for (int i = 0; i < file_count; i++) {
+                if (results[i].count < 0) { fprintf(stderr, "Error: could not encode %s\n", strcmp(paths[i], "-") == 0 ? "<stdin>" : paths[i]); status = 1; }
+                for (int64_t k = 0; k < results[i].count; k++) printf(k > 0 ? " %" PRIu32 : "%" PRIu32, ids[results[i].offset + k]);
+                putchar('\n');
+            }
+        }
+        uint64_t hits, misses;
+        encode_cache_stats(model->cache, &hits, &misses);
+        fprintf(stderr, "[INFO] Encode cache: %" PRIu64 " hits, %" PRIu64 " misses\n", hits, misses);
+    }
+    free(ids);
+    free_thread_pool(pool);
+    free_bpe_model(model);
+    for (int i = 0; i < file_count; i++) free(docs[i]);
+    free(docs);
+    free(lens);
+    free(results);
+    return status;
+}
+
+// Decode lines of whitespace-separated IDs from each file (stdin when none are given)
+int decode_files(const char *model_path, int file_count, char **paths) {
+    BPE_Model *model = open_bpe_model(model_path);
+    if (!model) return 1;
+    char *stdin_path[] = { "-" };
+    if (file_count == 0) { file_count = 1; paths = stdin_path; }
+    int status = 0;
+    for (int i = 0; i < file_count && status == 0; i++) {
+        int use_stdin = strcmp(paths[i], "-") == 0;
+        FILE *fp = use_stdin ? stdin : fopen(paths[i], "rb");
+        if (!fp) { fprintf(stderr, "Error: Could not open %s for reading\n", paths[i]); status = 1; break; }
+        size_t len;
+        char *text = read_stream(fp, &len);
+        if (!use_stdin) fclose(fp);
+        // A line of IDs is never longer than its text, so one buffer of len entries fits any line
+        uint32_t *ids = text ? malloc((len + 1) * sizeof(uint32_t)) : NULL;
+        char *out = NULL;
+        size_t out_capacity = 0;
+        size_t unknown = 0;
+        if (!ids) status = 1;
+        for (char *line = text; status == 0 && line && *line; ) {
+            char *end = strchr(line, '\n');
+            if (end) *end = '\0';
+            size_t n = 0;
+            char *p = line;
+            for (;;) {
+                while (isspace((unsigned char)*p)) p++;
+                if (!*p) break;
+                char *next;
+                unsigned long id = strtoul(p, &next, 10);
+                if (next == p || id > UINT32_MAX) { fprintf(stderr, "Error: bad token ID in %s\n", use_stdin ? "<stdin>" : paths[i]); status = 1; break; }
+                ids[n++] = (uint32_t)id;
+                p = next;
+            }
+            if (status != 0) break;
+            // IDs past the vocabulary decode as U+FFFD
+            for (size_t k = 0; k < n; k++) {
+                if (ids[k] >= model->symbol_count) unknown++;
+            }
+            int64_t written;
+            while ((written = bpe_decode(model, ids, n, out, out_capacity)) < 0) {
+                out_capacity = out_capacity ? out_capacity * 2 : READ_CHUNK_SIZE;
+                char *tmp = realloc(out, out_capacity);
+                if (!tmp) { fprintf(stderr, "Error: realloc failed in decode_files\n"); status = 1; break; }
+                out = tmp;
+            }
+            if (status != 0) break;
+            fwrite(out, 1, (size_t)written, stdout);
+            putchar('\n');
+            line = end ? end + 1 : NULL;
+        }
+        if (unknown > 0) fprintf(stderr, "Warning: %zu IDs in %s are not in the vocabulary\n", unknown, use_stdin ? "<stdin>" : paths[i]);
+        free(out);
+        free(ids);
+        free(text);
+    }
+    free_bpe_model(model);
+    return status;
+}
+
+// Print the ID of each line of each file (stdin when none are given) looked up as one token in
+// the vocabulary trie, or - when it is not a token; returns 1 when any line was missing
+int lookup_files(const char *model_path, int file_count, char **paths) {
+    BPE_Model *model = open_bpe_model(model_path);
+    if (!model) return 1;
+    char *stdin_path[] = { "-" };
+    if (file_count == 0) { file_count = 1; paths = stdin_path; }
+    int status = 0;
+    size_t missing = 0;
+    for (int i = 0; i < file_count && status == 0; i++) {
+        int use_stdin = strcmp(paths[i], "-") == 0;
+        FILE *fp = use_stdin ? stdin : fopen(paths[i], "rb");
+        if (!fp) { fprintf(stderr, "Error: Could not open %s for reading\n", paths[i]); status = 1; break; }
+        size_t len;
+        char *text = read_stream(fp, &len);
+        if (!use_stdin) fclose(fp);
+        if (!text) { status = 1; break; }
+        for (char *line = text; line < text + len; ) {
+            char *end = memchr(line, '\n', (size_t)(text + len - line));
+            size_t line_len = end ? (size_t)(end - line) : (size_t)(text + len - line);
+            if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+            uint32_t id = bpe_lookup_token(model, line, line_len);
+            if (id == BPE_UNK_ID) { missing++; printf("-\n"); }
+            else printf("%" PRIu32 "\n", id);
+            line = end ? end + 1 : text + len;
+        }
+        free(text);
+    }
+    free_bpe_model(model);
+    if (status == 0 && missing > 0) {
+        fprintf(stderr, "Warning: %zu lines are not in the vocabulary\n", missing);
+        status = 1;
+    }
+    return status;
+}
+
+// Print command-line help
+void print_usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-m merges] [-t threads] [-b] [-M mib | -k counters] [-f freq] [file ...]\n"
+        "       %s -e model [-g] [file ...]\n"
+        "       %s -d model [file ...]\n"
+        "       %s -l model [file ...]\n"
+        "  Trains on the given UTF-8 files ('-' reads stdin); regular files are\n"
+        "  memory-mapped, pipes are read in %d-byte chunks.\n"
+        "  Uses a built-in sample paragraph when no file is given.\n"
+        "  -m merges   number of BPE merges (default 50)\n"
+        "  -t threads  word-counting, pair-counting and encoding threads (default %d)\n"
+        "  -b          byte-level mode: start from the 256 byte values instead of characters\n"
+        "  -M mib      count words in at most mib MiB, spilling sorted runs to $TMPDIR; keeps\n"
+        "              every distinct word instead of the first %d\n"
+        "  -k counters approximate word counts with this many heavy-hitter counters\n"
+        "  -f freq     drop words seen fewer than freq times before merging\n"
+        "              (default 1, or %d with -k)\n"
+        "  -e model    encode the files (or stdin) with model.bin or merges.txt, one line of IDs each\n"
+        "  -d model    decode lines of IDs from the files (or stdin) back into text\n"
+        "  -l model    print the vocabulary ID of each line of the files (or stdin), or - if none\n"
+        "  -g          with -e, encode by greedy longest match instead of applying merges\n",
+        prog, prog, prog, prog, READ_CHUNK_SIZE, MAX_THREADS, MAX_VOCAB_SIZE, MIN_TOKEN_FREQ);
+}
+
+//
+// main: اجرای توکنایزر، تبدیل به زیرواژه و ادغام BPE پیشرفته و ذخیره واژگان در فایل
+//
+int main(int argc, char **argv) {
+    select_delimiter_kernel();
+    init_case_fold_table();
+
+    int num_merges = 50;
+    int num_threads = MAX_THREADS;
+    const char *model_path = NULL;
+    int model_op = 0;                   // 'e', 'd' or 'l', whichever named the model
+    int greedy = 0;
+    size_t spill_budget = 0;
+    int heavy_hitter_count = 0;
+    int64_t min_freq = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:t:be:d:l:gM:k:f:h")) != -1) {
+        switch (opt) {
+        case 'm': num_merges = atoi(optarg); break;
+        case 't': num_threads = atoi(optarg); break;
+        case 'b': byte_level = 1; break;
+        case 'e':
+        case 'd':
+        case 'l': model_path = optarg; model_op = opt; break;
+        case 'g': greedy = 1; break;
+        case 'M': spill_budget = (size_t)strtoull(optarg, NULL, 10) << 20; break;
+        case 'k': heavy_hitter_count = atoi(optarg); break;
+        case 'f': min_freq = strtoll(optarg, NULL, 10); break;
+        default: print_usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (spill_budget > 0 && heavy_hitter_count > 0) {
+        fprintf(stderr, "Error: -M and -k cannot be combined\n");
+        return 1;
+    }
+    if (min_freq > 0) min_token_freq = min_freq;
+    else if (heavy_hitter_count > 0) min_token_freq = MIN_TOKEN_FREQ;
+    if (model_path) {
+        if (model_op == 'd') return decode_files(model_path, argc - optind, argv + optind);
+        if (model_op == 'l') return lookup_files(model_path, argc - optind, argv + optind);
+        return encode_files(model_path, argc - optind, argv + optind, num_threads, greedy);
+    }
+
+    int dropped = -1;                   // words pruned while spilled or heavy-hitter counts were finished, -1 if none were
+    if (optind == argc) {
+        const char *text =
+            "Although post-structuralist critiques have problematized the notion of objective epistemology, especially within the context of late modernity’s fragmented narratives, the intertextual entanglement of discourse, power, and subjectivity remains a locus of theoretical contestation. Consequently, any hermeneutic attempt at deconstructing the meta-narratives embedded within institutionalized knowledge systems necessitates a nuanced understanding of semiotic multiplicity and ontological ambiguity.";
+
+        printf("Original text length: %zu\n\n", strlen(text));
+
+        TokenList *tokens = tokenize(text);
+        if (!tokens) { fprintf(stderr, "Tokenization failed.\n"); return 1; }
+        printf("[INFO] Found %d tokens\n", tokens->count);
+        free_tokens(tokens);
+    } else {
+        int64_t token_count = 0;
+        if (spill_budget > 0) {
+            word_spill = create_word_spill(spill_budget, SPILL_MAX_RUNS);
+            if (!word_spill) return 1;
+            vocab_limit = INT_MAX;              // every distinct word is kept
+        }
+        if (heavy_hitter_count > 0 && init_heavy_hitters(heavy_hitter_count) != 0) return 1;
+        for (int i = optind; i < argc; i++) {
+            int use_stdin = strcmp(argv[i], "-") == 0;
+            FILE *fp = use_stdin ? stdin : fopen(argv[i], "rb");
+            if (!fp) { fprintf(stderr, "Error: Could not open %s for reading\n", argv[i]); return 1; }
+            int64_t count = tokenize_file(fp, use_stdin ? "<stdin>" : argv[i], num_threads);
+            if (!use_stdin) fclose(fp);
+            if (count < 0) { fprintf(stderr, "Tokenization failed.\n"); return 1; }
+            token_count += count;
+        }
+        if (finish_word_spill(&dropped) != 0 || finish_heavy_hitters(&dropped) != 0) { fprintf(stderr, "Tokenization failed.\n"); return 1; }
+        printf("[INFO] Found %" PRId64 " tokens\n", token_count);
+    }
+    if (min_token_freq > 1) {
+        if (dropped < 0) dropped = prune_vocabulary(min_token_freq);
+        printf("[INFO] Dropped %d words seen fewer than %" PRId64 " times\n", dropped, min_token_freq);
+    }
+    printf("[INFO] Initial Vocabulary size: %d\n", vocab_size);
+
+    save_vocab();
+    save_vocab_to_file("init_vocab.txt");
+
+    convert_vocab_to_subwords();
+    printf("\n[INFO] Vocabulary after conversion to subwords:\n");
+    save_vocab();
+
+    bpe_subword_merge(num_merges, num_threads);
+
+    printf("\n[INFO] Final Vocabulary (after subword merges):\n");
+    save_vocab();
+
+    save_vocab_to_file("vocab.txt");
+    printf("[INFO] Vocabulary saved to 'vocab.txt'\n");
+    save_merges_to_file("merges.txt");
+    printf("[INFO] Merges saved to 'merges.txt'\n");
+    BPE_Model *model = load_bpe_model("merges.txt");
+    if (model && save_bpe_model(model, "model.bin") == 0) printf("[INFO] Model saved to 'model.bin'\n");
+    int status = model && model->byte_level && check_byte_round_trip(model) != 0;
+    free_bpe_model(model);
+
+    for (int i = 0; i < vocab_size; i++) {
+        free(vocabulary[i].token);
+        free(vocabulary[i].symbols);
+    }
+    free(vocabulary);
+    free(vocab_index);
+    free_symbols();
+    free_case_fold_table();
+    free(merge_list);
+
+    return status;
+}